@@ -6,3 +6,18 @@
 function(kdeconnect_add_plugin)
     kcoreaddons_add_plugin(${ARGN} INSTALL_NAMESPACE kdeconnect)
 endfunction()
+
+set(KDECONNECT_PACKET_GENERATOR ${CMAKE_CURRENT_LIST_DIR}/KDEConnectPacketGenerator.cmake)
+
+# Generates typed packet structs from a .packets schema, see KDEConnectPacketGenerator.cmake for the format.
+# foo.packets becomes foo_packets.h in the current binary dir, which is appended to the given sources variable.
+function(kdeconnect_generate_packets sources_var schema)
+    get_filename_component(_name ${schema} NAME_WE)
+    get_filename_component(_schema ${schema} ABSOLUTE)
+    set(_header ${CMAKE_CURRENT_BINARY_DIR}/${_name}_packets.h)
+    add_custom_command(OUTPUT ${_header}
+        COMMAND ${CMAKE_COMMAND} -DSCHEMA=${_schema} -DOUTPUT=${_header} -P ${KDECONNECT_PACKET_GENERATOR}
+        DEPENDS ${_schema} ${KDECONNECT_PACKET_GENERATOR}
+        COMMENT "Generating ${_name}_packets.h")
+    set(${sources_var} ${${sources_var}} ${_header} PARENT_SCOPE)
+endfunction()
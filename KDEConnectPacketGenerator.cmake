@@ -0,0 +1,133 @@
+# Copyright 2026 The KDE Connect developers
+# Redistribution and use is allowed according to the terms of the BSD license.
+
+# Generates a header with typed packet structs from a .packets schema file.
+# Run through kdeconnect_generate_packets, or by hand with:
+#   cmake -DSCHEMA=<file.packets> -DOUTPUT=<header.h> -P KDEConnectPacketGenerator.cmake
+#
+# The schema has one declaration per line, # starts a comment:
+#   packet <StructName> <packet type>
+#   <field type> <field name> [default value]
+# Fields belong to the last packet declared. The field types are bool, int, int64, double, string
+# and stringlist. Each struct gets the fields as members and a decode(const NetworkPacket&) method
+# that fills them in a single pass over the received body, and fails on the first field that doesn't
+# have its declared type.
+
+if(NOT SCHEMA OR NOT OUTPUT)
+    message(FATAL_ERROR "Usage: cmake -DSCHEMA=<file.packets> -DOUTPUT=<header.h> -P KDEConnectPacketGenerator.cmake")
+endif()
+
+set(_cpp_type_bool "bool")
+set(_cpp_type_int "int")
+set(_cpp_type_int64 "qint64")
+set(_cpp_type_double "double")
+set(_cpp_type_string "QString")
+set(_cpp_type_stringlist "QStringList")
+
+set(_default_bool "false")
+set(_default_int "0")
+set(_default_int64 "0")
+set(_default_double "0")
+
+get_filename_component(_schema_name ${SCHEMA} NAME)
+get_filename_component(_guard ${OUTPUT} NAME)
+string(TOUPPER "${_guard}" _guard)
+string(REGEX REPLACE "[^A-Z0-9]" "_" _guard "${_guard}")
+
+set(_structs "")
+set(_struct_name "")
+
+macro(_close_packet)
+    if(_struct_name)
+        set(_structs "${_structs}struct ${_struct_name}
+{
+    static QString packetType() { return QStringLiteral(\"${_packet_type}\"); }
+
+${_members}
+    //Returns false if np is not a ${_packet_type} packet or one of its fields doesn't have the type the
+    //schema declares, the struct is only partially filled in then. Fields not in the schema are ignored.
+    bool decode(const NetworkPacket& np)
+    {
+        if (np.type() != packetType()) {
+            return false;
+        }
+        return np.visitBody([this](const QString& fieldName, const QJsonValue& fieldValue) {
+            ${_readers}return true;
+        });
+    }
+};
+
+")
+    endif()
+endmacro()
+
+file(STRINGS ${SCHEMA} _lines)
+set(_line_number 0)
+foreach(_line IN LISTS _lines)
+    math(EXPR _line_number "${_line_number} + 1")
+    string(REGEX REPLACE "#.*$" "" _line "${_line}")
+    string(STRIP "${_line}" _line)
+    if(_line STREQUAL "")
+        continue()
+    endif()
+    string(REGEX REPLACE "[ \t]+" ";" _words "${_line}")
+    list(LENGTH _words _word_count)
+    list(GET _words 0 _keyword)
+
+    if(_keyword STREQUAL "packet")
+        if(NOT _word_count EQUAL 3)
+            message(FATAL_ERROR "${_schema_name}:${_line_number}: expected 'packet <StructName> <packet type>'")
+        endif()
+        _close_packet()
+        list(GET _words 1 _struct_name)
+        list(GET _words 2 _packet_type)
+        set(_members "")
+        set(_readers "")
+    else()
+        if(NOT _cpp_type_${_keyword})
+            message(FATAL_ERROR "${_schema_name}:${_line_number}: unknown field type '${_keyword}'")
+        endif()
+        if(NOT _struct_name)
+            message(FATAL_ERROR "${_schema_name}:${_line_number}: field declared before any packet")
+        endif()
+        if(_word_count LESS 2 OR _word_count GREATER 3)
+            message(FATAL_ERROR "${_schema_name}:${_line_number}: expected '<field type> <field name> [default value]'")
+        endif()
+        list(GET _words 1 _field)
+        if(_word_count EQUAL 3)
+            list(GET _words 2 _default)
+        else()
+            set(_default "${_default_${_keyword}}")
+        endif()
+        if(_default STREQUAL "")
+            set(_members "${_members}    ${_cpp_type_${_keyword}} ${_field};\n")
+        else()
+            set(_members "${_members}    ${_cpp_type_${_keyword}} ${_field} = ${_default};\n")
+        endif()
+        set(_readers "${_readers}if (fieldName == QLatin1String(\"${_field}\")) {
+                return PacketSchema::read(fieldValue, &${_field});
+            }
+            ")
+    endif()
+endforeach()
+_close_packet()
+
+set(_header "// Generated by KDEConnectPacketGenerator.cmake from ${_schema_name}, do not edit
+
+#ifndef ${_guard}
+#define ${_guard}
+
+#include <core/networkpacket.h>
+#include <core/packetschema.h>
+
+${_structs}#endif
+")
+
+# Only touch the header when it changes, so everything including it isn't rebuilt for nothing
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} _old_header)
+    if(_old_header STREQUAL _header)
+        return()
+    endif()
+endif()
+file(WRITE ${OUTPUT} "${_header}")
@@ -38,6 +38,7 @@ public:
     BluetoothDeviceLink(const QString& deviceId, LinkProvider* parent, QBluetoothSocket* socket);
 
     virtual QString name() override;
+    using DeviceLink::sendPacket;
     bool sendPacket(NetworkPacket& np) override;
 
     virtual void userRequestsPair() override;
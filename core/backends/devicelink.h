@@ -48,6 +48,8 @@ public:
     LinkProvider* provider() { return m_linkProvider; }
 
     virtual bool sendPacket(NetworkPacket& np) = 0;
+    //Links that keep the packet around (eg: loopback) can override this to take it over instead of copying it
+    virtual bool sendPacket(NetworkPacket&& np) { return sendPacket(np); }
 
     //user actions
     virtual void userRequestsPair() = 0;
@@ -27,23 +27,76 @@
 #include <netdb.h>
 #endif
 
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPointer>
+
 #include "kdeconnectconfig.h"
 #include "lanlinkprovider.h"
 #include "core/core_debug.h"
+#include "core/rangedpayload.h"
 
 DownloadJob::DownloadJob(const QHostAddress& address, const QVariantMap& transferInfo)
     : KJob()
     , m_address(address)
     , m_port(transferInfo[QStringLiteral("port")].toInt())
-    , m_socket(new QSslSocket)
+    , m_connected(0)
 {
-    LanLinkProvider::configureSslSocket(m_socket.data(), transferInfo.value(QStringLiteral("deviceId")).toString(), true);
+    const QString deviceId = transferInfo.value(QStringLiteral("deviceId")).toString();
+    const qint64 size = transferInfo.value(QStringLiteral("size"), -1).toLongLong();
+    const int streams = transferInfo.value(QStringLiteral("streams"), 0).toInt();
+
+    if (streams <= 0 || size < 0) {
+        //The uploader sends the whole payload through a single connection. It never splits payloads
+        //of unknown size, but if it did we'd still ask for all of it through one connection.
+        m_sockets.append(createSocket());
+        QSslSocket* socket = m_sockets.first().data();
+        LanLinkProvider::configureSslSocket(socket, deviceId, true);
+        if (streams > 0) {
+            connect(socket, &QSslSocket::encrypted, socket, [socket]() {
+                requestRange(socket, 0, -1);
+            });
+        }
+        m_payload = m_sockets.first().staticCast<QIODevice>();
+    } else {
+        QSharedPointer<RangedPayload> payload(new RangedPayload(size, streams));
+        payload->setContentId(transferInfo.value(QStringLiteral("contentId")).toString());
+        const QPointer<RangedPayload> weakPayload(payload.data());
+        for (int i = 0; i < streams; ++i) {
+            QSharedPointer<QSslSocket> socket = createSocket();
+            LanLinkProvider::configureSslSocket(socket.data(), deviceId, true);
+            payload->setRangeDevice(i, socket.staticCast<QIODevice>());
+            //Not connected to us: the job is done, and deleted, as soon as the sockets connect.
+            //By the time they are encrypted whoever reads the payload had the chance to resume it.
+            QSslSocket* rawSocket = socket.data();
+            connect(rawSocket, &QSslSocket::encrypted, rawSocket, [rawSocket, weakPayload, i]() {
+                if (weakPayload) {
+                    weakPayload->setRangeRequested(i);
+                    requestRange(rawSocket, weakPayload->rangeOffset(i), weakPayload->rangeLength(i));
+                }
+            });
+            m_sockets.append(socket);
+        }
+        m_payload = payload.staticCast<QIODevice>();
+    }
+}
 
-    connect(m_socket.data(), SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketFailed(QAbstractSocket::SocketError)));
-    connect(m_socket.data(), &QAbstractSocket::connected, this, &DownloadJob::socketConnected);
+QSharedPointer<QSslSocket> DownloadJob::createSocket()
+{
+    QSharedPointer<QSslSocket> socket(new QSslSocket);
+    connect(socket.data(), SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketFailed(QAbstractSocket::SocketError)));
+    connect(socket.data(), &QAbstractSocket::connected, this, &DownloadJob::socketConnected);
     // emit readChannelFinished when the socket gets disconnected. This seems to be a bug in upstream QSslSocket.
     // Needs investigation and upstreaming of the fix. QTBUG-62257
-    connect(m_socket.data(), &QAbstractSocket::disconnected, m_socket.data(), &QAbstractSocket::readChannelFinished);
+    connect(socket.data(), &QAbstractSocket::disconnected, socket.data(), &QAbstractSocket::readChannelFinished);
+    return socket;
+}
+
+void DownloadJob::requestRange(QSslSocket* socket, qint64 offset, qint64 length)
+{
+    //A length of -1 asks for everything from offset to the end
+    const QJsonObject request{{QStringLiteral("offset"), offset}, {QStringLiteral("length"), length}};
+    socket->write(QJsonDocument(request).toJson(QJsonDocument::Compact) + '\n');
 }
 
 DownloadJob::~DownloadJob()
@@ -55,23 +108,31 @@ void DownloadJob::start()
 {
     //TODO: Timeout?
     // Cannot use read only, might be due to ssl handshake, getting QIODevice::ReadOnly error and no connection
-    m_socket->connectToHostEncrypted(m_address.toString(), m_port, QIODevice::ReadWrite);
+    for (const QSharedPointer<QSslSocket>& socket : qAsConst(m_sockets)) {
+        socket->connectToHostEncrypted(m_address.toString(), m_port, QIODevice::ReadWrite);
+    }
 }
 
 void DownloadJob::socketFailed(QAbstractSocket::SocketError error)
 {
-    qWarning() << error << m_socket->errorString();
+    QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
+    qWarning() << error << socket->errorString();
+    if (this->error()) {
+        return; //Another of the connections failed already
+    }
     setError(error + 1);
-    setErrorText(m_socket->errorString());
+    setErrorText(socket->errorString());
     emitResult();
 }
 
 QSharedPointer<QIODevice> DownloadJob::getPayload()
 {
-    return m_socket.staticCast<QIODevice>();
+    return m_payload;
 }
 
 void DownloadJob::socketConnected()
 {
-    emitResult();
+    if (++m_connected == m_sockets.size() && !error()) {
+        emitResult();
+    }
 }
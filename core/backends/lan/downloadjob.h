@@ -29,9 +29,11 @@
 #include <QSharedPointer>
 #include <QSslSocket>
 #include <QBuffer>
+#include <QVector>
 
 #include "kdeconnectcore_export.h"
 
+class RangedPayload;
 
 class KDECONNECTCORE_EXPORT DownloadJob
     : public KJob
@@ -44,9 +46,15 @@ public:
     QSharedPointer<QIODevice> getPayload();
 
 private:
+    QSharedPointer<QSslSocket> createSocket();
+    static void requestRange(QSslSocket* socket, qint64 offset, qint64 length);
+
     QHostAddress m_address;
     qint16 m_port;
-    QSharedPointer<QSslSocket> m_socket;
+    //One per range when the payload is sent in ranges, see UploadJob::setStreamCount
+    QVector<QSharedPointer<QSslSocket>> m_sockets;
+    QSharedPointer<QIODevice> m_payload;
+    int m_connected;
 
 private Q_SLOTS:
     void socketFailed(QAbstractSocket::SocketError error);
@@ -19,6 +19,9 @@
  */
 
 #include <KLocalizedString>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QtEndian>
 
 #include "landevicelink.h"
 #include "core_debug.h"
@@ -27,32 +30,84 @@
 #include "uploadjob.h"
 #include "downloadjob.h"
 #include "socketlinereader.h"
+#include "lanlinkworker.h"
+#include "payloadchannel.h"
 #include "lanlinkprovider.h"
 
+//Anything bigger is written right away instead of waiting for more packets
+static const int MAX_COALESCED_BYTES = 64 * 1024;
+//Payload chunks are only queued while the socket has less than this waiting to be written,
+//so packets sent in the middle of a big transfer don't wait behind all of it
+static const qint64 PAYLOAD_HIGH_WATER_MARK = 256 * 1024;
+//Payloads at least this big go through their own connections, split in ranges sent in parallel
+static const qint64 STRIPED_PAYLOAD_THRESHOLD = 64 * 1024 * 1024;
+static const int STRIPED_PAYLOAD_STREAMS = 4;
+
 LanDeviceLink::LanDeviceLink(const QString& deviceId, LinkProvider* parent, QSslSocket* socket, ConnectionStarted connectionSource)
     : DeviceLink(deviceId, parent)
-    , m_socketLineReader(nullptr)
+    , m_worker(nullptr)
+    , m_useCbor(false)
+    , m_useDeflate(false)
+    , m_usePayloadChannel(false)
+    , m_usePayloadRanges(false)
+    , m_payloadChannel(nullptr)
+    , m_maxBatchPackets(64)
+    , m_maxBatchMsecs(10)
+    , m_batchSizeHistogram(8)
+    , m_deliveryQueued(false)
+    , m_bytesToWrite(0)
+    , m_sentRecords(0)
+    , m_sentBytes(0)
 {
+    m_sendBuffer.reserve(MAX_COALESCED_BYTES);
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(0);
+    connect(&m_flushTimer, &QTimer::timeout, this, &LanDeviceLink::flush);
+
     reset(socket, connectionSource);
 }
 
-void LanDeviceLink::reset(QSslSocket* socket, ConnectionStarted connectionSource)
+LanDeviceLink::~LanDeviceLink()
 {
-    if (m_socketLineReader) {
-        disconnect(m_socketLineReader->m_socket, &QAbstractSocket::disconnected, this, &QObject::deleteLater);
-        delete m_socketLineReader;
+    //The worker, and the socket with it, are deleted in their own thread
+    if (m_worker) {
+        m_worker->deleteLater();
     }
+}
 
-    m_socketLineReader = new SocketLineReader(socket, this);
+void LanDeviceLink::reset(QSslSocket* socket, ConnectionStarted connectionSource)
+{
+    if (m_worker) {
+        disconnect(m_worker, nullptr, this, nullptr);
+        //Packets the old connection already received are still delivered, before anything from the new one.
+        //Payload chunks go to the channel of the old connection, which goes away below.
+        for (const LanLinkWorker::Received& received : m_worker->takeReceived()) {
+            if (received.payloadChunk.isNull()) {
+                m_received.enqueue(received);
+            }
+        }
+        if (!m_received.isEmpty() && !m_deliveryQueued) {
+            m_deliveryQueued = true;
+            QMetaObject::invokeMethod(this, "dataReceived", Qt::QueuedConnection);
+        }
+        m_worker->deleteLater();
+    }
 
-    connect(socket, &QAbstractSocket::disconnected, this, &QObject::deleteLater);
-    connect(m_socketLineReader, &SocketLineReader::readyRead, this, &LanDeviceLink::dataReceived);
+    //Streams in flight belong to the old connection, the peer won't get the rest of them
+    delete m_payloadChannel;
+    m_payloadChannel = nullptr;
+    m_bytesToWrite = 0;
 
-    //We take ownership of the socket.
+    //We take ownership of the socket (through the worker).
     //When the link provider destroys us,
-    //the socket (and the reader) will be
-    //destroyed as well
-    socket->setParent(m_socketLineReader);
+    //the socket will be destroyed as well
+    m_worker = LanLinkWorker::adopt(socket);
+
+    //Queued even if the worker had nothing to do with threads, we always get its signals in the main thread
+    connect(m_worker, &LanLinkWorker::disconnected, this, &QObject::deleteLater, Qt::QueuedConnection);
+    connect(m_worker, &LanLinkWorker::received, this, &LanDeviceLink::takeReceived, Qt::QueuedConnection);
+    connect(m_worker, &LanLinkWorker::bytesWritten, this, &LanDeviceLink::bytesWritten, Qt::QueuedConnection);
+    m_worker->start();
 
     m_connectionSource = connectionSource;
 
@@ -60,12 +115,33 @@ void LanDeviceLink::reset(QSslSocket* socket, ConnectionStarted connectionSource
     DeviceLink::setPairStatus(certString.isEmpty()? PairStatus::NotPaired : PairStatus::Paired);
 }
 
+void LanDeviceLink::setPeerIdentity(const NetworkPacket& identityPacket)
+{
+    const QStringList encodings = identityPacket.get<QStringList>(QStringLiteral("packetEncodings"));
+    m_useCbor = NetworkPacket::cborSupported() && encodings.contains(QStringLiteral("cbor"));
+    const QStringList compression = identityPacket.get<QStringList>(QStringLiteral("packetCompression"));
+    m_useDeflate = compression.contains(QStringLiteral("deflate"));
+    const QStringList payloadTransports = identityPacket.get<QStringList>(QStringLiteral("payloadTransports"));
+    m_usePayloadChannel = payloadTransports.contains(QStringLiteral("channel"));
+    m_usePayloadRanges = payloadTransports.contains(QStringLiteral("ranges"));
+}
+
+PayloadChannel* LanDeviceLink::payloadChannel()
+{
+    if (!m_payloadChannel) {
+        m_payloadChannel = new PayloadChannel(this);
+        //Queued, so the packet announcing a stream is always in the send buffer before its first chunk
+        connect(m_payloadChannel, &PayloadChannel::dataPending, this, &LanDeviceLink::pumpPayloads, Qt::QueuedConnection);
+    }
+    return m_payloadChannel;
+}
+
 QHostAddress LanDeviceLink::hostAddress() const
 {
-    if (!m_socketLineReader) {
+    if (!m_worker) {
         return QHostAddress::Null;
     }
-    QHostAddress addr = m_socketLineReader->m_socket->peerAddress();
+    QHostAddress addr = m_worker->peerAddress();
     if (addr.protocol() == QAbstractSocket::IPv6Protocol) {
         bool success;
         QHostAddress convertedAddr = QHostAddress(addr.toIPv4Address(&success));
@@ -84,34 +160,195 @@ QString LanDeviceLink::name()
 
 bool LanDeviceLink::sendPacket(NetworkPacket& np)
 {
+    if (!m_worker->isConnected()) {
+        return false;
+    }
+
     if (np.hasPayload()) {
-        np.setPayloadTransferInfo(sendPayload(np)->transferInfo());
+        if (m_usePayloadChannel && payloadChannel()->canAddOutgoing(np.payloadSize())) {
+            const quint32 streamId = payloadChannel()->addOutgoing(np.payload(), np.payloadSize());
+            np.setPayloadTransferInfo({{QStringLiteral("stream"), streamId}});
+        } else {
+            np.setPayloadTransferInfo(sendPayload(np)->transferInfo());
+        }
     }
 
-    int written = m_socketLineReader->write(np.serialize());
+    //Packets sent in the same event loop iteration (or within the send latency) go out in a single write
+    if (!m_useCbor && !m_useDeflate) {
+        np.serialize(m_sendBuffer);
+    } else {
+        const QByteArray encodedPacket = m_useCbor? np.serializeCbor() : np.serialize();
+        const QByteArray compressedPacket = m_useDeflate? compressPacket(encodedPacket) : QByteArray();
+        if (!compressedPacket.isNull()) {
+            SocketLineReader::appendBinaryFrame(m_sendBuffer, DeflateFrame, compressedPacket);
+        } else if (m_useCbor) {
+            SocketLineReader::appendBinaryFrame(m_sendBuffer, CborFrame, encodedPacket);
+        } else {
+            m_sendBuffer += encodedPacket;
+        }
+    }
+
+    //Pairing changes can be followed by the link going away, don't leave them in the queue
+    if (m_sendBuffer.size() >= MAX_COALESCED_BYTES || np.type() == PACKET_TYPE_PAIR) {
+        flush();
+    } else if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
 
     //Actually we can't detect if a packet is received or not. We keep TCP
     //"ESTABLISHED" connections that look legit (return true when we use them),
     //but that are actually broken (until keepalive detects that they are down).
-    return (written != -1);
+    return true;
+}
+
+void LanDeviceLink::flush()
+{
+    m_flushTimer.stop();
+    if (m_sendBuffer.isEmpty()) {
+        return;
+    }
+
+    m_worker->write(m_sendBuffer);
+    ++m_sentRecords;
+    m_sentBytes += m_sendBuffer.size();
+    m_bytesToWrite += m_sendBuffer.size();
+    //The I/O thread has its own reference to the data now, don't make it detach by reusing the buffer
+    m_sendBuffer = QByteArray();
+    m_sendBuffer.reserve(MAX_COALESCED_BYTES);
+}
+
+void LanDeviceLink::bytesWritten(qint64 bytes)
+{
+    m_bytesToWrite = qMax<qint64>(0, m_bytesToWrite - bytes);
+    pumpPayloads();
+}
+
+void LanDeviceLink::pumpPayloads()
+{
+    if (!m_payloadChannel) {
+        return;
+    }
+    while (m_payloadChannel->hasOutgoing() && m_bytesToWrite < PAYLOAD_HIGH_WATER_MARK) {
+        const QByteArray chunk = m_payloadChannel->nextChunk();
+        if (chunk.isNull()) {
+            break; //Waiting for the sources to have more data
+        }
+        SocketLineReader::appendBinaryFrame(m_sendBuffer, PayloadFrame, chunk);
+        flush();
+    }
+}
+
+void LanDeviceLink::setSendLatency(int msecs)
+{
+    m_flushTimer.setInterval(msecs);
+}
+
+//Most packets are tiny, compressing them would cost more than it saves
+static const int COMPRESSION_THRESHOLD = 4096;
+//qUncompress trusts the size header, don't let a peer make us allocate more than this
+static const quint32 MAX_UNCOMPRESSED_SIZE = 64 * 1024 * 1024;
+
+QByteArray LanDeviceLink::compressPacket(const QByteArray& encodedPacket)
+{
+    if (encodedPacket.size() < COMPRESSION_THRESHOLD) {
+        return QByteArray();
+    }
+    //Favour speed, this runs in the main thread while the link waits
+    const QByteArray compressed = qCompress(encodedPacket, 1);
+    if (compressed.size() >= encodedPacket.size() - encodedPacket.size() / 8) {
+        return QByteArray(); //Already compressed data, eg: a base64 encoded image
+    }
+    return compressed;
+}
+
+QByteArray LanDeviceLink::uncompressPacket(const QByteArray& compressed)
+{
+    if (compressed.size() < 4) {
+        return QByteArray();
+    }
+    const quint32 expectedSize = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(compressed.constData()));
+    if (expectedSize > MAX_UNCOMPRESSED_SIZE) {
+        qCWarning(KDECONNECT_CORE) << "Ignoring compressed packet that claims to be" << expectedSize << "bytes";
+        return QByteArray();
+    }
+    const QByteArray encodedPacket = qUncompress(compressed);
+    if (encodedPacket.isEmpty()) {
+        return QByteArray();
+    }
+    return encodedPacket;
 }
 
 UploadJob* LanDeviceLink::sendPayload(const NetworkPacket& np)
 {
     UploadJob* job = new UploadJob(np.payload(), deviceId());
+    if (m_usePayloadRanges) {
+        job->setStreamCount(np.payloadSize() >= STRIPED_PAYLOAD_THRESHOLD? STRIPED_PAYLOAD_STREAMS : 1, np.payloadSize());
+    }
     job->start();
     return job;
 }
 
+void LanDeviceLink::setReceiveBudget(int maxPackets, int maxMsecs)
+{
+    Q_ASSERT(maxPackets > 0);
+    m_maxBatchPackets = maxPackets;
+    m_maxBatchMsecs = maxMsecs;
+}
+
+void LanDeviceLink::takeReceived()
+{
+    if (!m_worker) {
+        return;
+    }
+    for (const LanLinkWorker::Received& received : m_worker->takeReceived()) {
+        m_received.enqueue(received);
+    }
+    dataReceived();
+}
+
 void LanDeviceLink::dataReceived()
 {
-    if (m_socketLineReader->bytesAvailable() == 0) return;
+    m_deliveryQueued = false;
 
-    const QByteArray serializedPacket = m_socketLineReader->readLine();
-    NetworkPacket packet(QString::null);
-    NetworkPacket::unserialize(serializedPacket, &packet);
+    //Deliver everything that is queued instead of going through the event loop once per packet,
+    //but don't hog the main thread when a burst arrives
+    QPointer<LanDeviceLink> self(this);
+    QElapsedTimer batchTimer;
+    batchTimer.start();
+    int delivered = 0;
+    while (!m_received.isEmpty()) {
+        if (delivered >= m_maxBatchPackets || (delivered > 0 && batchTimer.elapsed() >= m_maxBatchMsecs)) {
+            if (!m_deliveryQueued) {
+                m_deliveryQueued = true;
+                QMetaObject::invokeMethod(this, "dataReceived", Qt::QueuedConnection);
+            }
+            break;
+        }
+        LanLinkWorker::Received received = m_received.dequeue();
+        if (!received.payloadChunk.isNull()) {
+            //Chunks are cheap and don't count against the budget
+            payloadChannel()->receiveChunk(received.payloadChunk);
+            continue;
+        }
+        receivePacket(received.packet);
+        if (!self) {
+            return; //A plugin got rid of us
+        }
+        ++delivered;
+    }
 
-    //qCDebug(KDECONNECT_CORE) << "LanDeviceLink dataReceived" << serializedPacket;
+    if (delivered > 0) {
+        int bucket = 0;
+        while ((delivered >> (bucket + 1)) > 0 && bucket < m_batchSizeHistogram.size() - 1) {
+            ++bucket;
+        }
+        ++m_batchSizeHistogram[bucket];
+    }
+}
+
+void LanDeviceLink::receivePacket(NetworkPacket& packet)
+{
+    //qCDebug(KDECONNECT_CORE) << "LanDeviceLink dataReceived" << packet.type();
 
     if (packet.type() == PACKET_TYPE_PAIR) {
         //TODO: Handle pair/unpair requests and forward them (to the pairing handler?)
@@ -122,25 +359,41 @@ void LanDeviceLink::dataReceived()
     if (packet.hasPayloadTransferInfo()) {
         //qCDebug(KDECONNECT_CORE) << "HasPayloadTransferInfo";
         QVariantMap transferInfo = packet.payloadTransferInfo();
+        if (transferInfo.contains(QStringLiteral("stream"))) {
+            //The payload comes through this same connection, and is buffered in memory until it's read.
+            //Only paired devices get to make us do that, their chunks are dropped otherwise.
+            if (pairStatus() != Paired) {
+                qCWarning(KDECONNECT_CORE) << "Ignoring" << packet.type() << "packet with a payload from an unpaired device";
+                return;
+            }
+            const quint32 streamId = transferInfo.value(QStringLiteral("stream")).toUInt();
+            const QSharedPointer<QIODevice> payload = payloadChannel()->addIncoming(streamId, packet.payloadSize());
+            if (!payload) {
+                //Our own sender never asks for more than the channel accepts, the peer can't be trusted with this connection
+                qCWarning(KDECONNECT_CORE) << "Dropping the link to" << deviceId() << "after a" << packet.type() << "packet whose payload can't come through it";
+                m_worker->abort();
+                m_received.clear();
+                return;
+            }
+            packet.setPayload(payload, packet.payloadSize());
+            Q_EMIT receivedPacket(packet);
+            return;
+        }
         //FIXME: The next two lines shouldn't be needed! Why are they here?
         transferInfo.insert(QStringLiteral("useSsl"), true);
         transferInfo.insert(QStringLiteral("deviceId"), deviceId());
-        DownloadJob* job = new DownloadJob(m_socketLineReader->peerAddress(), transferInfo);
+        transferInfo.insert(QStringLiteral("size"), packet.payloadSize());
+        DownloadJob* job = new DownloadJob(m_worker->peerAddress(), transferInfo);
         job->start();
         packet.setPayload(job->getPayload(), packet.payloadSize());
     }
 
     Q_EMIT receivedPacket(packet);
-
-    if (m_socketLineReader->bytesAvailable() > 0) {
-        QMetaObject::invokeMethod(this, "dataReceived", Qt::QueuedConnection);
-    }
-
 }
 
 void LanDeviceLink::userRequestsPair()
 {
-    if (m_socketLineReader->peerCertificate().isNull()) {
+    if (m_worker->peerCertificate().isNull()) {
         Q_EMIT pairingError(i18n("This device cannot be paired because it is running an old version of KDE Connect."));
     } else {
         qobject_cast<LanLinkProvider*>(provider())->userRequestsPair(deviceId());
@@ -154,7 +407,7 @@ void LanDeviceLink::userRequestsUnpair()
 
 void LanDeviceLink::setPairStatus(PairStatus status)
 {
-    if (status == Paired && m_socketLineReader->peerCertificate().isNull()) {
+    if (status == Paired && m_worker->peerCertificate().isNull()) {
         Q_EMIT pairingError(i18n("This device cannot be paired because it is running an old version of KDE Connect."));
         return;
     }
@@ -162,8 +415,8 @@ void LanDeviceLink::setPairStatus(PairStatus status)
     DeviceLink::setPairStatus(status);
     if (status == Paired) {
         Q_ASSERT(KdeConnectConfig::instance()->trustedDevices().contains(deviceId()));
-        Q_ASSERT(!m_socketLineReader->peerCertificate().isNull());
-        KdeConnectConfig::instance()->setDeviceProperty(deviceId(), QStringLiteral("certificate"), m_socketLineReader->peerCertificate().toPem());
+        Q_ASSERT(!m_worker->peerCertificate().isNull());
+        KdeConnectConfig::instance()->setDeviceProperty(deviceId(), QStringLiteral("certificate"), m_worker->peerCertificate().toPem());
     }
 }
 
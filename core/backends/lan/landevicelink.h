@@ -25,12 +25,16 @@
 #include <QString>
 #include <QSslSocket>
 #include <QSslCertificate>
+#include <QQueue>
+#include <QTimer>
+#include <QVector>
 
 #include <kdeconnectcore_export.h>
 #include "backends/devicelink.h"
+#include "lanlinkworker.h"
 #include "uploadjob.h"
 
-class SocketLineReader;
+class PayloadChannel;
 
 class KDECONNECTCORE_EXPORT LanDeviceLink
     : public DeviceLink
@@ -39,13 +43,27 @@ class KDECONNECTCORE_EXPORT LanDeviceLink
 
 public:
     enum ConnectionStarted : bool { Locally, Remotely };
+    //Binary frame types, see SocketLineReader
+    enum FrameType : char { CborFrame = 0x01, DeflateFrame = 0x02, PayloadFrame = 0x03 };
 
+    //The socket is handed to a LanLinkWorker (if it isn't in one already), which reads and writes it in an I/O thread
     LanDeviceLink(const QString& deviceId, LinkProvider* parent, QSslSocket* socket, ConnectionStarted connectionSource);
+    ~LanDeviceLink() override;
     void reset(QSslSocket* socket, ConnectionStarted connectionSource);
+    //Picks the optional features to use on this link from what the peer announced in its identity packet
+    void setPeerIdentity(const NetworkPacket& identityPacket);
 
     QString name() override;
+    using DeviceLink::sendPacket;
     bool sendPacket(NetworkPacket& np) override;
     UploadJob* sendPayload(const NetworkPacket& np);
+    //Sent packets are queued and written together once control returns to the event loop, or after the
+    //send latency if one is set. Call flush() after sending a packet that shouldn't wait for that.
+    void flush();
+    void setSendLatency(int msecs);
+    //Socket writes handed to the I/O thread (each one becomes one TLS record, or a few if it's above 16 KiB) and bytes written
+    quint64 sentRecords() const { return m_sentRecords; }
+    quint64 sentBytes() const { return m_sentBytes; }
 
     void userRequestsPair() override;
     void userRequestsUnpair() override;
@@ -56,13 +74,47 @@ public:
 
     QHostAddress hostAddress() const;
 
+    //Received packets are delivered in batches, each batch stops after maxPackets packets or
+    //maxMsecs milliseconds and the rest waits for the next event loop iteration
+    void setReceiveBudget(int maxPackets, int maxMsecs);
+    //Bucket i counts the batches of [2^i, 2^(i+1)) packets, the last bucket also counts all the bigger ones
+    QVector<quint64> batchSizeHistogram() const { return m_batchSizeHistogram; }
+
+    //Deflates an encoded packet for sending it as a compressed frame, returns a null QByteArray when it isn't worth it
+    static QByteArray compressPacket(const QByteArray& encodedPacket);
+    //Returns a null QByteArray if the data is corrupt or would inflate to something unreasonably large
+    static QByteArray uncompressPacket(const QByteArray& compressed);
+
 private Q_SLOTS:
     void dataReceived();
+    void takeReceived();
+    void bytesWritten(qint64 bytes);
+    void pumpPayloads();
 
 private:
-    SocketLineReader* m_socketLineReader;
+    void receivePacket(NetworkPacket& packet);
+    PayloadChannel* payloadChannel();
+
+    LanLinkWorker* m_worker;
     ConnectionStarted m_connectionSource;
-    QHostAddress m_hostAddress;
+    bool m_useCbor;
+    bool m_useDeflate;
+    bool m_usePayloadChannel;
+    bool m_usePayloadRanges;
+    PayloadChannel* m_payloadChannel;
+    int m_maxBatchPackets;
+    int m_maxBatchMsecs;
+    QVector<quint64> m_batchSizeHistogram;
+    //Parsed in the I/O thread, waiting to be delivered within the receive budget
+    QQueue<LanLinkWorker::Received> m_received;
+    bool m_deliveryQueued;
+
+    QByteArray m_sendBuffer;
+    QTimer m_flushTimer;
+    //Handed to the I/O thread but not written to the socket yet
+    qint64 m_bytesToWrite;
+    quint64 m_sentRecords;
+    quint64 m_sentBytes;
 };
 
 #endif
@@ -28,38 +28,69 @@
 #include <netdb.h>
 #endif
 
+#if defined(Q_PROCESSOR_ARM_64) && defined(Q_OS_LINUX)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #include <QHostInfo>
 #include <QTcpServer>
 #include <QNetworkProxy>
 #include <QUdpSocket>
 #include <QNetworkSession>
 #include <QNetworkConfigurationManager>
+#include <QNetworkInterface>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
 #include <QSslCipher>
 #include <QSslConfiguration>
+#include <QSslKey>
 
 #include "daemon.h"
 #include "landevicelink.h"
+#include "lanlinkworker.h"
 #include "lanpairinghandler.h"
 #include "kdeconnectconfig.h"
 
 #define MIN_VERSION_WITH_SSL_SUPPORT 6
 
+//Connections to announcing devices that can be in the TCP connection and identity exchange at the same time,
+//the announcements that arrive while we are at the limit wait for a free slot
+static const int MAX_CONCURRENT_HANDSHAKES = 16;
+
 LanLinkProvider::LanLinkProvider(bool testMode)
-    : m_testMode(testMode)
+    : m_identityHandshakes(0)
+    , m_maxPendingHandshakes(MAX_PENDING_HANDSHAKES)
+    , m_handshakeTimeout(HANDSHAKE_TIMEOUT_MSECS)
+    , m_announcementBurst(ANNOUNCEMENT_BURST)
+    , m_announcementsPerSecond(ANNOUNCEMENTS_PER_SECOND)
+    , m_reconnectDebounce(RECONNECT_DEBOUNCE_MSECS)
+    , m_testMode(testMode)
 {
     m_tcpPort = 0;
+    m_clock.start();
+
+    setHandshakeLimits(MAX_PENDING_HANDSHAKES, HANDSHAKE_TIMEOUT_MSECS);
+    connect(&m_handshakeTimeoutTimer, &QTimer::timeout, this, &LanLinkProvider::abortExpiredHandshakes);
 
     m_combineBroadcastsTimer.setInterval(0); // increase this if waiting a single event-loop iteration is not enough
     m_combineBroadcastsTimer.setSingleShot(true);
     connect(&m_combineBroadcastsTimer, &QTimer::timeout, this, &LanLinkProvider::broadcastToNetwork);
 
     connect(&m_udpSocket, &QIODevice::readyRead, this, &LanLinkProvider::newUdpConnection);
+    connect(&m_udp6Socket, &QIODevice::readyRead, this, &LanLinkProvider::newUdpConnection);
+
+    //Directly, sockets configured right after the trust changed must not get the old configuration
+    connect(KdeConnectConfig::instance(), &KdeConnectConfig::deviceTrustChanged, this, &LanLinkProvider::clearSslConfigurationCache, Qt::DirectConnection);
 
     m_server = new Server(this);
     m_server->setProxy(QNetworkProxy::NoProxy);
     connect(m_server,&QTcpServer::newConnection,this, &LanLinkProvider::newConnection);
 
     m_udpSocket.setProxy(QNetworkProxy::NoProxy);
+    m_udp6Socket.setProxy(QNetworkProxy::NoProxy);
 
     //Detect when a network interface changes status, so we announce ourelves in the new network
     QNetworkConfigurationManager* networkManager = new QNetworkConfigurationManager(this);
@@ -77,6 +108,9 @@ void LanLinkProvider::onNetworkConfigurationChanged(const QNetworkConfiguration&
 
 LanLinkProvider::~LanLinkProvider()
 {
+    for (const PendingConnect& pending : qAsConst(m_queuedAnnouncements)) {
+        delete pending.np;
+    }
 }
 
 void LanLinkProvider::onStart()
@@ -86,6 +120,11 @@ void LanLinkProvider::onStart()
     bool success = m_udpSocket.bind(bindAddress, UDP_PORT, QUdpSocket::ShareAddress);
     Q_ASSERT(success);
 
+    //Announcements sent to ff02::1 by devices on IPv6 networks. Not having IPv6 is fine, we still have IPv4.
+    if (!m_testMode && !m_udp6Socket.bind(QHostAddress::AnyIPv6, UDP_PORT, QUdpSocket::ShareAddress)) {
+        qCDebug(KDECONNECT_CORE) << "Not listening for IPv6 announcements:" << m_udp6Socket.errorString();
+    }
+
     qCDebug(KDECONNECT_CORE) << "onStart";
 
     m_tcpPort = MIN_TCP_PORT;
@@ -105,11 +144,15 @@ void LanLinkProvider::onStop()
 {
     qCDebug(KDECONNECT_CORE) << "onStop";
     m_udpSocket.close();
+    m_udp6Socket.close();
     m_server->close();
 }
 
 void LanLinkProvider::onNetworkChange()
 {
+    //Our name or the port we listen on may have changed
+    m_serializedIdentity.clear();
+
     if (m_combineBroadcastsTimer.isActive()) {
         qCDebug(KDECONNECT_CORE()) << "Preventing duplicate broadcasts";
         return;
@@ -132,9 +175,7 @@ void LanLinkProvider::broadcastToNetwork()
 
     QHostAddress destAddress = m_testMode? QHostAddress::LocalHost : QHostAddress(QStringLiteral("255.255.255.255"));
 
-    NetworkPacket np(QLatin1String(""));
-    NetworkPacket::createIdentityPacket(&np);
-    np.set(QStringLiteral("tcpPort"), m_tcpPort);
+    const QByteArray& identity = serializedIdentityPacket();
 
 #ifdef Q_OS_WIN
     //On Windows we need to broadcast from every local IP address to reach all networks
@@ -149,33 +190,161 @@ void LanLinkProvider::broadcastToNetwork()
                 if (sourceAddress.protocol() == QAbstractSocket::IPv4Protocol && sourceAddress != QHostAddress::LocalHost) {
                     qCDebug(KDECONNECT_CORE()) << "Broadcasting as" << sourceAddress;
                     sendSocket.bind(sourceAddress, UDP_PORT);
-                    sendSocket.writeDatagram(np.serialize(), destAddress, UDP_PORT);
+                    sendSocket.writeDatagram(identity, destAddress, UDP_PORT);
                     sendSocket.close();
                 }
             }
         }
     }
+    if (!m_testMode) {
+        probeKnownDevices(identity);
+    }
+#elif defined(Q_OS_LINUX)
+    //255.255.255.255 only goes out through the interface of the default route, so on machines with several
+    //networks (more than one NIC, VPNs, container bridges) we send a directed broadcast to each subnet instead,
+    //and an IPv6 link-local multicast on each interface for networks where the devices only have IPv6.
+    bool sent = false;
+    if (!m_testMode) {
+        const QHostAddress linkLocalPrefix(QStringLiteral("fe80::"));
+        const QHostAddress allNodes(QStringLiteral("ff02::1"));
+        for (const QNetworkInterface& iface : QNetworkInterface::allInterfaces()) {
+            const QNetworkInterface::InterfaceFlags flags = iface.flags();
+            if (!(flags & QNetworkInterface::IsUp) || !(flags & QNetworkInterface::IsRunning) || (flags & QNetworkInterface::IsLoopBack)) {
+                continue;
+            }
+            bool multicastSent = false;
+            for (const QNetworkAddressEntry& ifaceAddress : iface.addressEntries()) {
+                const QHostAddress address = ifaceAddress.ip();
+                if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+                    if ((flags & QNetworkInterface::CanBroadcast) && !ifaceAddress.broadcast().isNull()) {
+                        qCDebug(KDECONNECT_CORE()) << "Broadcasting to" << ifaceAddress.broadcast() << "on" << iface.name();
+                        sent = m_udpSocket.writeDatagram(identity, ifaceAddress.broadcast(), UDP_PORT) > 0 || sent;
+                    }
+                } else if (address.protocol() == QAbstractSocket::IPv6Protocol && !multicastSent
+                           && (flags & QNetworkInterface::CanMulticast) && address.isInSubnet(linkLocalPrefix, 10)
+                           && m_udp6Socket.state() == QAbstractSocket::BoundState) {
+                    QHostAddress multicastAddress = allNodes;
+                    multicastAddress.setScopeId(iface.name());
+                    qCDebug(KDECONNECT_CORE()) << "Multicasting to" << multicastAddress;
+                    multicastSent = m_udp6Socket.writeDatagram(identity, multicastAddress, UDP_PORT) > 0;
+                }
+            }
+        }
+        probeKnownDevices(identity);
+    }
+    if (!sent) {
+        //No interfaces with IPv4 broadcast, or we can't list them
+        m_udpSocket.writeDatagram(identity, destAddress, UDP_PORT);
+    }
 #else
-    m_udpSocket.writeDatagram(np.serialize(), destAddress, UDP_PORT);
+    m_udpSocket.writeDatagram(identity, destAddress, UDP_PORT);
+    if (!m_testMode) {
+        probeKnownDevices(identity);
+    }
 #endif
 
 }
 
+//Devices we were connected to before are told we are here directly at their last address, so they can
+//connect back as soon as they get it instead of waiting for a broadcast that may not reach their network.
+void LanLinkProvider::probeKnownDevices(const QByteArray& identity)
+{
+    KdeConnectConfig* config = KdeConnectConfig::instance();
+    for (const QString& deviceId : config->trustedDevices()) {
+        if (m_links.contains(deviceId)) {
+            continue;
+        }
+        const QHostAddress address(config->getDeviceProperty(deviceId, QStringLiteral("lastKnownAddress")));
+        if (address.isNull()) {
+            continue;
+        }
+        qCDebug(KDECONNECT_CORE()) << "Probing" << deviceId << "at" << address;
+        udpSocketFor(address).writeDatagram(identity, address, UDP_PORT);
+    }
+}
+
+QUdpSocket& LanLinkProvider::udpSocketFor(const QHostAddress& address)
+{
+    const bool ipv6 = address.protocol() == QAbstractSocket::IPv6Protocol && m_udp6Socket.state() == QAbstractSocket::BoundState;
+    return ipv6? m_udp6Socket : m_udpSocket;
+}
+
+const QByteArray& LanLinkProvider::serializedIdentityPacket()
+{
+    if (m_serializedIdentity.isEmpty()) {
+        NetworkPacket np(QLatin1String(""));
+        NetworkPacket::createIdentityPacket(&np);
+        np.set(QStringLiteral("tcpPort"), m_tcpPort);
+        np.serialize(m_serializedIdentity);
+    }
+    return m_serializedIdentity;
+}
+
+//Finds the deviceId of a JSON identity packet without parsing it. Returns a null string if it's
+//not there as a plain string, like when it has escape sequences, the full parse deals with those.
+static QString peekDeviceId(const QByteArray& datagram)
+{
+    static const QByteArray key = QByteArrayLiteral("\"deviceId\"");
+    int pos = datagram.indexOf(key);
+    if (pos < 0) {
+        return QString();
+    }
+    pos += key.size();
+    while (pos < datagram.size() && (datagram.at(pos) == ' ' || datagram.at(pos) == ':')) {
+        ++pos;
+    }
+    if (pos >= datagram.size() || datagram.at(pos) != '"') {
+        return QString();
+    }
+    ++pos;
+    const int end = datagram.indexOf('"', pos);
+    if (end < 0) {
+        return QString();
+    }
+    const int escape = datagram.indexOf('\\', pos);
+    if (escape >= 0 && escape < end) {
+        return QString();
+    }
+    return QString::fromUtf8(datagram.constData() + pos, end - pos);
+}
+
 //I'm the existing device, a new device is kindly introducing itself.
 //I will create a TcpSocket and try to connect. This can result in either connected() or connectError().
 void LanLinkProvider::newUdpConnection() //udpBroadcastReceived
 {
-    while (m_udpSocket.hasPendingDatagrams()) {
+    QUdpSocket* udpSocket = qobject_cast<QUdpSocket*>(sender());
+    if (!udpSocket) {
+        udpSocket = &m_udpSocket;
+    }
+    while (udpSocket->hasPendingDatagrams()) {
 
         QByteArray datagram;
-        datagram.resize(m_udpSocket.pendingDatagramSize());
+        datagram.resize(udpSocket->pendingDatagramSize());
         QHostAddress sender;
 
-        m_udpSocket.readDatagram(datagram.data(), datagram.size(), &sender);
+        udpSocket->readDatagram(datagram.data(), datagram.size(), &sender);
 
         if (sender.isLoopback() && !m_testMode)
             continue;
 
+        //Where the IPv6 socket isn't IPv6 only, IPv4 broadcasts reach it too as ::ffff: mapped addresses.
+        //m_udpSocket gets those already, don't handle (and count) every announcement twice.
+        if (udpSocket == &m_udp6Socket) {
+            bool isV4Mapped = false;
+            sender.toIPv4Address(&isV4Mapped);
+            if (isV4Mapped)
+                continue;
+        }
+
+        //Phones announce themselves often, and most of the time we are connected to them already.
+        //Recognize those before parsing the whole packet, and don't tear down a link that was just set up.
+        const QString peekedDeviceId = peekDeviceId(datagram);
+        if (!peekedDeviceId.isEmpty() && isRecentlyLinked(peekedDeviceId, sender)) {
+            ++m_handshakeCounters.announcements;
+            ++m_handshakeCounters.linked;
+            continue;
+        }
+
         NetworkPacket* receivedPacket = new NetworkPacket(QLatin1String(""));
         bool success = NetworkPacket::unserialize(datagram, receivedPacket);
 
@@ -184,47 +353,252 @@ void LanLinkProvider::newUdpConnection() //udpBroadcastReceived
         //qCDebug(KDECONNECT_CORE) << "Datagram " << datagram.data() ;
 
         if (!success || receivedPacket->type() != PACKET_TYPE_IDENTITY) {
+            ++m_handshakeCounters.malformed;
             delete receivedPacket;
             continue;
         }
 
-        if (receivedPacket->get<QString>(QStringLiteral("deviceId")) == KdeConnectConfig::instance()->deviceId()) {
+        const QString deviceId = receivedPacket->get<QString>(QStringLiteral("deviceId"));
+        if (deviceId == KdeConnectConfig::instance()->deviceId()) {
             //qCDebug(KDECONNECT_CORE) << "Ignoring my own broadcast";
             delete receivedPacket;
             continue;
         }
 
-        int tcpPort = receivedPacket->get<int>(QStringLiteral("tcpPort"));
+        ++m_handshakeCounters.announcements;
+        if (deviceId != peekedDeviceId && isRecentlyLinked(deviceId, sender)) {
+            ++m_handshakeCounters.linked;
+            delete receivedPacket;
+            continue;
+        }
+
+        //Admission control, so a chatty (or hostile) network can't make us open sockets without end
+        if (!admitAnnouncement(sender)) {
+            ++m_handshakeCounters.rateLimited;
+            delete receivedPacket;
+            continue;
+        }
+        if (isHandshakePending(deviceId)) {
+            ++m_handshakeCounters.duplicates;
+            delete receivedPacket;
+            continue;
+        }
+        if (pendingHandshakes() >= m_maxPendingHandshakes) {
+            ++m_handshakeCounters.tableFull;
+            qCDebug(KDECONNECT_CORE) << "Too many pending handshakes, ignoring the announcement from" << deviceId;
+            delete receivedPacket;
+            continue;
+        }
+        ++m_handshakeCounters.accepted;
+
+        PendingConnect pending;
+        pending.np = receivedPacket;
+        pending.sender = sender;
+        pending.state = Connecting;
+        pending.age.start();
+        m_queuedAnnouncements.enqueue(pending);
+    }
+
+    startQueuedConnections();
+    if (pendingHandshakes() > 0 && !m_handshakeTimeoutTimer.isActive()) {
+        m_handshakeTimeoutTimer.start();
+    }
+}
+
+void LanLinkProvider::setHandshakeLimits(int maxPending, int timeoutMsecs)
+{
+    m_maxPendingHandshakes = maxPending;
+    m_handshakeTimeout = timeoutMsecs;
+    //Handshakes are given up on between timeoutMsecs and 1.25 * timeoutMsecs after they started
+    m_handshakeTimeoutTimer.setInterval(qBound(100, timeoutMsecs / 4, 1000));
+}
+
+void LanLinkProvider::setAnnouncementRateLimit(int burst, int perSecond)
+{
+    m_announcementBurst = burst;
+    m_announcementsPerSecond = perSecond;
+    m_announcementBudgets.clear();
+}
+
+//Addresses we keep a budget for, a storm from spoofed addresses just resets them
+static const int MAX_TRACKED_ANNOUNCERS = 1024;
+
+//Token bucket per source address
+bool LanLinkProvider::admitAnnouncement(const QHostAddress& sender)
+{
+    const qint64 now = m_clock.elapsed();
+    if (m_announcementBudgets.size() >= MAX_TRACKED_ANNOUNCERS && !m_announcementBudgets.contains(sender)) {
+        m_announcementBudgets.clear();
+    }
+    QHash<QHostAddress, AnnouncementBudget>::iterator budget = m_announcementBudgets.find(sender);
+    if (budget == m_announcementBudgets.end()) {
+        budget = m_announcementBudgets.insert(sender, {m_announcementBurst, now});
+    } else {
+        const qint64 refill = (now - budget->refilled) * m_announcementsPerSecond / 1000;
+        if (refill > 0) {
+            budget->tokens = int(qMin<qint64>(m_announcementBurst, budget->tokens + refill));
+            budget->refilled = now;
+        }
+    }
+    if (budget->tokens <= 0) {
+        return false;
+    }
+    --budget->tokens;
+    return true;
+}
+
+void LanLinkProvider::setReconnectDebounce(int msecs)
+{
+    m_reconnectDebounce = msecs;
+}
+
+//A device that announces itself again right after we connected to it is most likely still announcing the same
+//network change. After RECONNECT_DEBOUNCE_MSECS we believe it, it may have restarted and lost the connection.
+//The same IPv4 address comes as ::ffff:a.b.c.d through the IPv6 socket, and QHostAddress doesn't see them as equal
+static QHostAddress withoutV4Mapping(const QHostAddress& address)
+{
+    bool isIPv4;
+    const QHostAddress ipv4Address(address.toIPv4Address(&isIPv4));
+    return isIPv4? ipv4Address : address;
+}
+
+bool LanLinkProvider::isRecentlyLinked(const QString& deviceId, const QHostAddress& sender) const
+{
+    const LanDeviceLink* link = m_links.value(deviceId);
+    if (!link || m_clock.elapsed() - m_linkedSince.value(deviceId) >= m_reconnectDebounce) {
+        return false;
+    }
+    //If it comes from somewhere else the device moved to another network, and the link is as good as gone
+    return withoutV4Mapping(link->hostAddress()) == withoutV4Mapping(sender);
+}
+
+bool LanLinkProvider::isHandshakePending(const QString& deviceId) const
+{
+    //There are at most m_maxPendingHandshakes of them
+    for (const PendingConnect& pending : m_queuedAnnouncements) {
+        if (pending.np->get<QString>(QStringLiteral("deviceId")) == deviceId) {
+            return true;
+        }
+    }
+    for (const PendingConnect& pending : m_receivedIdentityPackets) {
+        if (pending.np && pending.np->get<QString>(QStringLiteral("deviceId")) == deviceId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QSslSocket* LanLinkProvider::handshakeSocket(QObject* worker) const
+{
+    //Only compares the pointer, the worker may be gone already if we gave up on its handshake
+    for (QMap<QSslSocket*, PendingConnect>::const_iterator it = m_receivedIdentityPackets.constBegin(); it != m_receivedIdentityPackets.constEnd(); ++it) {
+        if (it->worker && it->worker == worker) {
+            return it.key();
+        }
+    }
+    return nullptr;
+}
+
+void LanLinkProvider::removePendingConnection(QSslSocket* socket)
+{
+    identityExchangeFinished(socket);
+    delete m_receivedIdentityPackets.take(socket).np;
+}
+
+void LanLinkProvider::abortExpiredHandshakes()
+{
+    const quint64 timedOutBefore = m_handshakeCounters.timedOut;
+
+    while (!m_queuedAnnouncements.isEmpty() && m_queuedAnnouncements.head().age.hasExpired(m_handshakeTimeout)) {
+        delete m_queuedAnnouncements.dequeue().np;
+        ++m_handshakeCounters.timedOut;
+    }
+
+    QList<QSslSocket*> expired;
+    for (QMap<QSslSocket*, PendingConnect>::const_iterator it = m_receivedIdentityPackets.constBegin(); it != m_receivedIdentityPackets.constEnd(); ++it) {
+        if (it->age.hasExpired(m_handshakeTimeout)) {
+            expired.append(it.key());
+        }
+    }
+    for (QSslSocket* socket : qAsConst(expired)) {
+        LanLinkWorker* worker = m_receivedIdentityPackets.value(socket).worker;
+        if (worker) {
+            //The socket lives in an I/O thread, deleting the worker deletes it there
+            disconnect(worker, nullptr, this, nullptr);
+            worker->deleteLater();
+        } else {
+            disconnect(socket, nullptr, this, nullptr);
+            socket->abort();
+            socket->deleteLater();
+        }
+        removePendingConnection(socket);
+        ++m_handshakeCounters.timedOut;
+    }
+
+    if (m_handshakeCounters.timedOut != timedOutBefore) {
+        qCDebug(KDECONNECT_CORE) << "Gave up on" << m_handshakeCounters.timedOut - timedOutBefore << "handshakes -"
+                                 << m_handshakeCounters.announcements << "announcements," << m_handshakeCounters.accepted << "accepted,"
+                                 << m_handshakeCounters.duplicates << "duplicates," << m_handshakeCounters.rateLimited << "rate limited,"
+                                 << m_handshakeCounters.tableFull << "with the table full," << m_handshakeCounters.timedOut << "timed out";
+    }
+    if (pendingHandshakes() == 0) {
+        m_handshakeTimeoutTimer.stop();
+    }
+}
+
+//Every connection goes Connecting -> SendingIdentity -> Encrypting without blocking, the first two
+//states are the ones limited by MAX_CONCURRENT_HANDSHAKES
+void LanLinkProvider::startQueuedConnections()
+{
+    while (m_identityHandshakes < MAX_CONCURRENT_HANDSHAKES && !m_queuedAnnouncements.isEmpty()) {
+        const PendingConnect pending = m_queuedAnnouncements.dequeue();
+        const int tcpPort = pending.np->get<int>(QStringLiteral("tcpPort"));
 
-        //qCDebug(KDECONNECT_CORE) << "Received Udp identity packet from" << sender << " asking for a tcp connection on port " << tcpPort;
+        //qCDebug(KDECONNECT_CORE) << "Received Udp identity packet from" << pending.sender << " asking for a tcp connection on port " << tcpPort;
 
         QSslSocket* socket = new QSslSocket(this);
         socket->setProxy(QNetworkProxy::NoProxy);
-        m_receivedIdentityPackets[socket].np = receivedPacket;
-        m_receivedIdentityPackets[socket].sender = sender;
+        QMap<QSslSocket*, PendingConnect>::iterator it = m_receivedIdentityPackets.insert(socket, pending);
+        it->age.start();
+        ++m_identityHandshakes;
         connect(socket, &QAbstractSocket::connected, this, &LanLinkProvider::connected);
         connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(connectError()));
-        socket->connectToHost(sender, tcpPort);
+        socket->connectToHost(pending.sender, tcpPort);
     }
 }
 
+//The socket is done with the part of the handshake that takes a slot, successfully or not
+void LanLinkProvider::identityExchangeFinished(QSslSocket* socket)
+{
+    QMap<QSslSocket*, PendingConnect>::iterator it = m_receivedIdentityPackets.find(socket);
+    if (it == m_receivedIdentityPackets.end() || it->state == Encrypting) {
+        return;
+    }
+    it->state = Encrypting;
+    --m_identityHandshakes;
+    //Not from here, we may be in the middle of handling this socket
+    QMetaObject::invokeMethod(this, "startQueuedConnections", Qt::QueuedConnection);
+}
+
 void LanLinkProvider::connectError()
 {
     QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
     if (!socket) return;
     disconnect(socket, &QAbstractSocket::connected, this, &LanLinkProvider::connected);
+    disconnect(socket, &QIODevice::bytesWritten, this, &LanLinkProvider::identitySent);
     disconnect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(connectError()));
 
+    QMap<QSslSocket*, PendingConnect>::const_iterator it = m_receivedIdentityPackets.constFind(socket);
+    if (it == m_receivedIdentityPackets.constEnd()) return; //We gave up on it already
+
     qCDebug(KDECONNECT_CORE) << "Fallback (1), try reverse connection (send udp packet)" << socket->errorString();
-    NetworkPacket np(QLatin1String(""));
-    NetworkPacket::createIdentityPacket(&np);
-    np.set(QStringLiteral("tcpPort"), m_tcpPort);
-    m_udpSocket.writeDatagram(np.serialize(), m_receivedIdentityPackets[socket].sender, UDP_PORT);
+    const QHostAddress sender = it->sender;
+    udpSocketFor(sender).writeDatagram(serializedIdentityPacket(), sender, UDP_PORT);
 
     //The socket we created didn't work, and we didn't manage
     //to create a LanDeviceLink from it, deleting everything.
-    delete m_receivedIdentityPackets.take(socket).np;
-    delete socket;
+    removePendingConnection(socket);
+    socket->deleteLater();
 }
 
 //We received a UDP packet and answered by connecting to them by TCP. This gets called on a succesful connection.
@@ -234,97 +608,132 @@ void LanLinkProvider::connected()
 
     if (!socket) return;
     disconnect(socket, &QAbstractSocket::connected, this, &LanLinkProvider::connected);
-    disconnect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(connectError()));
+    QMap<QSslSocket*, PendingConnect>::iterator it = m_receivedIdentityPackets.find(socket);
+    if (it == m_receivedIdentityPackets.end()) return;
 
     configureSocket(socket);
 
     // If socket disconnects due to any reason after connection, link on ssl failure
     connect(socket, &QAbstractSocket::disconnected, socket, &QObject::deleteLater);
 
-    NetworkPacket* receivedPacket = m_receivedIdentityPackets[socket].np;
-    const QString& deviceId = receivedPacket->get<QString>(QStringLiteral("deviceId"));
     //qCDebug(KDECONNECT_CORE) << "Connected" << socket->isWritable();
 
-    // If network is on ssl, do not believe when they are connected, believe when handshake is completed
-    NetworkPacket np2(QLatin1String(""));
-    NetworkPacket::createIdentityPacket(&np2);
-    socket->write(np2.serialize());
-    bool success = socket->waitForBytesWritten();
+    // If network is on ssl, do not believe when they are connected, believe when handshake is completed.
+    // Errors while sending the identity still go to connectError
+    it->state = SendingIdentity;
+    connect(socket, &QIODevice::bytesWritten, this, &LanLinkProvider::identitySent);
+    socket->write(serializedIdentityPacket());
+}
 
-    if (success) {
+void LanLinkProvider::identitySent()
+{
+    QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
+    if (!socket || socket->bytesToWrite() > 0) return;
+    disconnect(socket, &QIODevice::bytesWritten, this, &LanLinkProvider::identitySent);
+    disconnect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(connectError()));
+    identityExchangeFinished(socket);
 
-        qCDebug(KDECONNECT_CORE) << "TCP connection done (i'm the existing device)";
+    NetworkPacket* receivedPacket = m_receivedIdentityPackets.value(socket).np;
+    if (!receivedPacket) return;
+    const QString& deviceId = receivedPacket->get<QString>(QStringLiteral("deviceId"));
 
-        // if ssl supported
-        if (receivedPacket->get<int>(QStringLiteral("protocolVersion")) >= MIN_VERSION_WITH_SSL_SUPPORT) {
+    qCDebug(KDECONNECT_CORE) << "TCP connection done (i'm the existing device)";
 
-            bool isDeviceTrusted = KdeConnectConfig::instance()->trustedDevices().contains(deviceId);
-            configureSslSocket(socket, deviceId, isDeviceTrusted);
+    // if ssl supported
+    if (receivedPacket->get<int>(QStringLiteral("protocolVersion")) >= MIN_VERSION_WITH_SSL_SUPPORT) {
+        setPeerSslProfile(deviceId, *receivedPacket);
 
-            qCDebug(KDECONNECT_CORE) << "Starting server ssl (I'm the client TCP socket)";
+        qCDebug(KDECONNECT_CORE) << "Starting server ssl (I'm the client TCP socket)";
+        startEncryption(socket, deviceId, QSslSocket::SslServerMode);
 
-            connect(socket, &QSslSocket::encrypted, this, &LanLinkProvider::encrypted);
+        return; // Return statement prevents from deleting received packet, needed in slot "encrypted"
+    } else {
+        qWarning() << receivedPacket->get<QString>(QStringLiteral("deviceName")) << "uses an old protocol version, this won't work";
+        //addLink(deviceId, socket, receivedPacket, LanDeviceLink::Remotely);
+    }
 
-            if (isDeviceTrusted) {
-                connect(socket, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrors(QList<QSslError>)));
-            }
+    removePendingConnection(socket);
+    //We don't delete the socket because now it's owned by the LanDeviceLink
+}
+
+//Hands the socket to an I/O thread for the TLS handshake, we hear back in encrypted(), sslErrors() or handshakeDisconnected()
+void LanLinkProvider::startEncryption(QSslSocket* socket, const QString& deviceId, QSslSocket::SslMode mode)
+{
+    bool isDeviceTrusted = KdeConnectConfig::instance()->trustedDevices().contains(deviceId);
+    configureSslSocket(socket, deviceId, isDeviceTrusted);
 
-            socket->startServerEncryption();
+    //From now on the socket is deleted with its worker, and only from the main thread,
+    //so the worker pointer in m_receivedIdentityPackets can't be left dangling
+    disconnect(socket, &QAbstractSocket::disconnected, socket, &QObject::deleteLater);
+    disconnect(socket, &QAbstractSocket::disconnected, this, &LanLinkProvider::incomingDisconnected);
 
-            return; // Return statement prevents from deleting received packet, needed in slot "encrypted"
-        } else {
-            qWarning() << receivedPacket->get<QString>(QStringLiteral("deviceName")) << "uses an old protocol version, this won't work";
-            //addLink(deviceId, socket, receivedPacket, LanDeviceLink::Remotely);
-        }
+    //The handshake, and everything the link does with the socket afterwards, happens in an I/O thread
+    LanLinkWorker* worker = LanLinkWorker::adopt(socket);
+    QMap<QSslSocket*, PendingConnect>::iterator it = m_receivedIdentityPackets.find(socket);
+    Q_ASSERT(it != m_receivedIdentityPackets.end()); //Both callers found it a moment ago
+    it->worker = worker;
+    connect(worker, &LanLinkWorker::encrypted, this, &LanLinkProvider::encrypted, Qt::QueuedConnection);
+    connect(worker, &LanLinkWorker::disconnected, this, &LanLinkProvider::handshakeDisconnected, Qt::QueuedConnection);
 
+    if (isDeviceTrusted) {
+        connect(worker, &LanLinkWorker::sslErrors, this, &LanLinkProvider::sslErrors, Qt::QueuedConnection);
+    }
+
+    if (mode == QSslSocket::SslServerMode) {
+        worker->startServerEncryption();
     } else {
-        //I think this will never happen, but if it happens the deviceLink
-        //(or the socket that is now inside it) might not be valid. Delete them.
-        qCDebug(KDECONNECT_CORE) << "Fallback (2), try reverse connection (send udp packet)";
-        m_udpSocket.writeDatagram(np2.serialize(), m_receivedIdentityPackets[socket].sender, UDP_PORT);
+        worker->startClientEncryption();
     }
+}
 
-    delete m_receivedIdentityPackets.take(socket).np;
-    //We don't delete the socket because now it's owned by the LanDeviceLink
+void LanLinkProvider::handshakeDisconnected()
+{
+    QSslSocket* socket = handshakeSocket(sender());
+    if (!socket) return;
+    LanLinkWorker* worker = m_receivedIdentityPackets.value(socket).worker;
+    disconnect(worker, nullptr, this, nullptr);
+    worker->deleteLater();
+    removePendingConnection(socket);
 }
 
 void LanLinkProvider::encrypted()
 {
     qCDebug(KDECONNECT_CORE) << "Socket succesfully stablished an SSL connection";
 
-    QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
-    if (!socket) return;
-    disconnect(socket, &QSslSocket::encrypted, this, &LanLinkProvider::encrypted);
-    disconnect(socket, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrors(QList<QSslError>)));
+    QSslSocket* socket = handshakeSocket(sender());
+    if (!socket) return; //We gave up on it while the signal was on its way
+    const PendingConnect pending = m_receivedIdentityPackets.value(socket);
+    LanLinkWorker* worker = pending.worker;
+    disconnect(worker, nullptr, this, nullptr);
 
-    Q_ASSERT(socket->mode() != QSslSocket::UnencryptedMode);
-    LanDeviceLink::ConnectionStarted connectionOrigin = (socket->mode() == QSslSocket::SslClientMode)? LanDeviceLink::Locally : LanDeviceLink::Remotely;
+    Q_ASSERT(worker->sslMode() != QSslSocket::UnencryptedMode);
+    LanDeviceLink::ConnectionStarted connectionOrigin = (worker->sslMode() == QSslSocket::SslClientMode)? LanDeviceLink::Locally : LanDeviceLink::Remotely;
 
-    NetworkPacket* receivedPacket = m_receivedIdentityPackets[socket].np;
+    NetworkPacket* receivedPacket = pending.np;
     const QString& deviceId = receivedPacket->get<QString>(QStringLiteral("deviceId"));
 
     addLink(deviceId, socket, receivedPacket, connectionOrigin);
 
     // Copied from connected slot, now delete received packet
-    delete m_receivedIdentityPackets.take(socket).np;
+    removePendingConnection(socket);
 }
 
-void LanLinkProvider::sslErrors(const QList<QSslError>& errors)
+void LanLinkProvider::sslErrors(const QList<QSslError>& errors, const QString& peerVerifyName)
 {
-    QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
+    QSslSocket* socket = handshakeSocket(sender());
     if (!socket) return;
-
-    disconnect(socket, &QSslSocket::encrypted, this, &LanLinkProvider::encrypted);
-    disconnect(socket, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrors(QList<QSslError>)));
+    LanLinkWorker* worker = m_receivedIdentityPackets.value(socket).worker;
+    disconnect(worker, nullptr, this, nullptr);
 
     qCDebug(KDECONNECT_CORE) << "Failing due to " << errors;
-    Device* device = Daemon::instance()->getDevice(socket->peerVerifyName());
+    Device* device = Daemon::instance()->getDevice(peerVerifyName);
     if (device) {
         device->unpair();
     }
 
-    delete m_receivedIdentityPackets.take(socket).np;
-    // Socket disconnects itself on ssl error and will be deleted by deleteLater slot, no need to delete manually
+    removePendingConnection(socket);
+    // Socket disconnects itself on ssl error, we won't hear about it anymore so delete it now
+    worker->deleteLater();
 }
 
 //I'm the new device and this is the answer to my UDP identity packet (no data received yet). They are connecting to us through TCP, and they should send an identity.
@@ -334,22 +743,50 @@ void LanLinkProvider::newConnection()
 
     while (m_server->hasPendingConnections()) {
         QSslSocket* socket = m_server->nextPendingConnection();
+        //Tracked from the start, or a peer could keep as many connections open as it liked by never sending its identity
+        if (pendingHandshakes() >= m_maxPendingHandshakes) {
+            ++m_handshakeCounters.tableFull;
+            socket->abort();
+            socket->deleteLater();
+            continue;
+        }
+        PendingConnect& pending = *m_receivedIdentityPackets.insert(socket, PendingConnect());
+        pending.sender = socket->peerAddress();
+        pending.age.start();
+        if (!m_handshakeTimeoutTimer.isActive()) {
+            m_handshakeTimeoutTimer.start();
+        }
+
         configureSocket(socket);
         //This socket is still managed by us (and child of the QTcpServer), if
         //it disconnects before we manage to pass it to a LanDeviceLink, it's
         //our responsibility to delete it. We do so with this connection.
         connect(socket, &QAbstractSocket::disconnected,
                 socket, &QObject::deleteLater);
+        connect(socket, &QAbstractSocket::disconnected,
+                this, &LanLinkProvider::incomingDisconnected);
         connect(socket, &QIODevice::readyRead,
                 this, &LanLinkProvider::dataReceived);
 
     }
 }
 
+//An incoming connection went away before its TLS handshake started
+void LanLinkProvider::incomingDisconnected()
+{
+    QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
+    if (!socket) return;
+    removePendingConnection(socket);
+}
+
 //I'm the new device and this is the answer to my UDP identity packet (data received)
 void LanLinkProvider::dataReceived()
 {
     QSslSocket* socket = qobject_cast<QSslSocket*>(sender());
+    if (!socket) return;
+    //Tracked since newConnection, unless it went away or we gave up on it
+    QMap<QSslSocket*, PendingConnect>::iterator it = m_receivedIdentityPackets.find(socket);
+    if (it == m_receivedIdentityPackets.end()) return;
 
     const QByteArray data = socket->readLine();
 
@@ -370,7 +807,10 @@ void LanLinkProvider::dataReceived()
     }
 
     // Needed in "encrypted" if ssl is used, similar to "connected"
-    m_receivedIdentityPackets[socket].np = np;
+    //The deadline to send the identity started when we accepted the connection, the TLS handshake gets its own
+    delete it->np; //If they sent more than one identity
+    it->np = np;
+    it->age.start();
 
     const QString& deviceId = np->get<QString>(QStringLiteral("deviceId"));
     //qCDebug(KDECONNECT_CORE) << "Handshaking done (i'm the new device)";
@@ -379,24 +819,15 @@ void LanLinkProvider::dataReceived()
     disconnect(socket, &QIODevice::readyRead, this, &LanLinkProvider::dataReceived);
 
     if (np->get<int>(QStringLiteral("protocolVersion")) >= MIN_VERSION_WITH_SSL_SUPPORT) {
-
-        bool isDeviceTrusted = KdeConnectConfig::instance()->trustedDevices().contains(deviceId);
-        configureSslSocket(socket, deviceId, isDeviceTrusted);
+        setPeerSslProfile(deviceId, *np);
 
         qCDebug(KDECONNECT_CORE) << "Starting client ssl (but I'm the server TCP socket)";
-
-        connect(socket, &QSslSocket::encrypted, this, &LanLinkProvider::encrypted);
-
-        if (isDeviceTrusted) {
-            connect(socket, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrors(QList<QSslError>)));
-        }
-
-        socket->startClientEncryption();
+        startEncryption(socket, deviceId, QSslSocket::SslClientMode);
 
     } else {
         qWarning() << np->get<QString>(QStringLiteral("deviceName")) << "uses an old protocol version, this won't work";
         //addLink(deviceId, socket, np, LanDeviceLink::Locally);
-        delete m_receivedIdentityPackets.take(socket).np;
+        removePendingConnection(socket);
     }
 }
 
@@ -409,6 +840,7 @@ void LanLinkProvider::deviceLinkDestroyed(QObject* destroyedDeviceLink)
     if (linkIterator != m_links.end()) {
         Q_ASSERT(linkIterator.value() == destroyedDeviceLink);
         m_links.erase(linkIterator);
+        m_linkedSince.remove(id);
         auto pairingHandler = m_pairingHandlers.take(id);
         if (pairingHandler) {
             pairingHandler->deleteLater();
@@ -417,7 +849,49 @@ void LanLinkProvider::deviceLinkDestroyed(QObject* destroyedDeviceLink)
 
 }
 
-void LanLinkProvider::configureSslSocket(QSslSocket* socket, const QString& deviceId, bool isDeviceTrusted)
+//AES-GCM is only fast with the AES instructions, without them ChaCha20-Poly1305 is several times faster
+static bool hasAesInstructions()
+{
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes");
+#elif defined(Q_PROCESSOR_ARM_64) && defined(Q_OS_LINUX)
+    return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+    return true;
+#endif
+}
+
+static QList<QSslCipher> supportedCiphers(const QStringList& names)
+{
+    QList<QSslCipher> ciphers;
+    for (const QString& name : names) {
+        const QSslCipher cipher(name);
+        if (!cipher.isNull()) { //Not all of them are available in every TLS library
+            ciphers.append(cipher);
+        }
+    }
+    return ciphers;
+}
+
+static QList<QSslCipher> modernCiphers()
+{
+    //TLS 1.3 suites first, then the TLS 1.2 ones for our RSA certificates and for ECDSA ones
+    QStringList aesGcm = {
+        QStringLiteral("TLS_AES_128_GCM_SHA256"), QStringLiteral("TLS_AES_256_GCM_SHA384"),
+        QStringLiteral("ECDHE-RSA-AES128-GCM-SHA256"), QStringLiteral("ECDHE-RSA-AES256-GCM-SHA384"),
+        QStringLiteral("ECDHE-ECDSA-AES128-GCM-SHA256"), QStringLiteral("ECDHE-ECDSA-AES256-GCM-SHA384"),
+    };
+    QStringList chacha = {
+        QStringLiteral("TLS_CHACHA20_POLY1305_SHA256"),
+        QStringLiteral("ECDHE-RSA-CHACHA20-POLY1305"),
+        QStringLiteral("ECDHE-ECDSA-CHACHA20-POLY1305"),
+    };
+    return supportedCiphers(hasAesInstructions()? aesGcm + chacha : chacha + aesGcm);
+}
+
+//Everything but the peer specific bits: the ciphers, and our certificate and key read from disk
+static QSslConfiguration buildSslConfiguration(LanLinkProvider::SslProfile profile)
 {
     // Setting supported ciphers manually
     // Top 3 ciphers are for new Android devices, botton two are for old Android devices
@@ -434,19 +908,179 @@ void LanLinkProvider::configureSslSocket(QSslSocket* socket, const QString& devi
     QSslConfiguration sslConfig;
     sslConfig.setCiphers(socketCiphers);
     sslConfig.setProtocol(QSsl::TlsV1_0);
+    //Keep the session ticket the server gives us, so the next connection can skip the full handshake
+    sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+
+    sslConfig.setLocalCertificate(KdeConnectConfig::instance()->certificate());
+    QFile privateKeyFile(KdeConnectConfig::instance()->privateKeyPath());
+    if (privateKeyFile.open(QIODevice::ReadOnly)) {
+        sslConfig.setPrivateKey(QSslKey(privateKeyFile.readAll(), QSsl::Rsa));
+    } else {
+        qCWarning(KDECONNECT_CORE) << "Could not read the private key" << privateKeyFile.fileName();
+    }
+    sslConfig.setPeerVerifyMode(QSslSocket::QueryPeer);
+
+    if (profile == LanLinkProvider::ModernSslProfile) {
+        const QList<QSslCipher> ciphers = modernCiphers();
+        if (ciphers.isEmpty()) {
+            qCWarning(KDECONNECT_CORE) << "The TLS library has none of the modern ciphers, using the legacy ones";
+            return sslConfig;
+        }
+        sslConfig.setCiphers(ciphers);
+        sslConfig.setProtocol(QSsl::TlsV1_2OrLater);
+    }
+    return sslConfig;
+}
+
+namespace {
+struct TrustedSslConfiguration {
+    LanLinkProvider::SslProfile profile;
+    QSslConfiguration configuration;
+};
+
+//The configurations built so far. Our own certificate and key don't change while we run, the ones of
+//each device are dropped by clearSslConfigurationCache whenever KdeConnectConfig changes its trust.
+struct SslConfigurationCache {
+    QHash<int, QSslConfiguration> base; //By SslProfile
+    QHash<QString, TrustedSslConfiguration> trusted;
+};
+
+struct HandshakeStatistics {
+    int handshakes = 0;
+    int withTicket = 0;
+    qint64 totalMsecs = 0;
+};
+}
+
+static SslConfigurationCache s_sslConfigurations;
+static QHash<QString, LanLinkProvider::SslProfile> s_peerSslProfiles;
+//configureSslSocket runs for the payload jobs too, and the cache is cleared from wherever KdeConnectConfig is used.
+//Guards s_sslConfigurations and s_peerSslProfiles.
+static QMutex s_sslConfigurationsMutex;
+//The last session ticket each trusted device gave us when we were the TLS client
+static QHash<QString, QByteArray> s_sessionTickets;
+static HandshakeStatistics s_handshakeStatistics;
+//The tickets and the statistics are updated from the I/O threads the handshakes run in
+static QMutex s_handshakeMutex;
+
+//Called with s_sslConfigurationsMutex held
+static QSslConfiguration baseSslConfiguration(LanLinkProvider::SslProfile profile)
+{
+    auto it = s_sslConfigurations.base.constFind(profile);
+    if (it == s_sslConfigurations.base.constEnd()) {
+        it = s_sslConfigurations.base.insert(profile, buildSslConfiguration(profile));
+    }
+    return *it;
+}
+
+static void rememberSessionTicket(QSslSocket* socket, const QString& deviceId)
+{
+    if (socket->mode() != QSslSocket::SslClientMode) {
+        return;
+    }
+    const QByteArray ticket = socket->sslConfiguration().sessionTicket();
+    if (!ticket.isEmpty()) {
+        QMutexLocker locker(&s_handshakeMutex);
+        s_sessionTickets.insert(deviceId, ticket);
+    }
+}
+
+void LanLinkProvider::setPeerSslProfile(const QString& deviceId, const NetworkPacket& identityPacket)
+{
+    const QStringList tlsProfiles = identityPacket.get<QStringList>(QStringLiteral("tlsProfiles"));
+    setPeerSslProfile(deviceId, tlsProfiles.contains(QStringLiteral("modern"))? ModernSslProfile : LegacySslProfile);
+}
 
+void LanLinkProvider::setPeerSslProfile(const QString& deviceId, SslProfile profile)
+{
+    QMutexLocker locker(&s_sslConfigurationsMutex);
+    s_peerSslProfiles.insert(deviceId, profile);
+}
+
+void LanLinkProvider::clearSslConfigurationCache(const QString& deviceId)
+{
+    {
+        QMutexLocker locker(&s_sslConfigurationsMutex);
+        s_sslConfigurations.trusted.remove(deviceId);
+    }
+    //The ticket is from a session with whoever had the old certificate
+    QMutexLocker locker(&s_handshakeMutex);
+    s_sessionTickets.remove(deviceId);
+}
+
+LanLinkProvider::SslProfile LanLinkProvider::sslProfile(const QString& deviceId)
+{
+    //Devices we haven't heard from yet get the profile everyone supports
+    QMutexLocker locker(&s_sslConfigurationsMutex);
+    return s_peerSslProfiles.value(deviceId, LegacySslProfile);
+}
+
+void LanLinkProvider::configureSslSocket(QSslSocket* socket, const QString& deviceId, bool isDeviceTrusted)
+{
+    QSslConfiguration sslConfig;
+    {
+        QMutexLocker locker(&s_sslConfigurationsMutex);
+        const SslProfile profile = s_peerSslProfiles.value(deviceId, LegacySslProfile); //sslProfile(), under the same lock
+        if (isDeviceTrusted) {
+            TrustedSslConfiguration& cached = s_sslConfigurations.trusted[deviceId];
+            if (cached.configuration.isNull() || cached.profile != profile) {
+                const QString certString = KdeConnectConfig::instance()->getDeviceProperty(deviceId, QStringLiteral("certificate"), QString());
+                cached.profile = profile;
+                cached.configuration = baseSslConfiguration(profile);
+                cached.configuration.setCaCertificates({QSslCertificate(certString.toLatin1())});
+                cached.configuration.setPeerVerifyMode(QSslSocket::VerifyPeer);
+            }
+            sslConfig = cached.configuration;
+        } else {
+            sslConfig = baseSslConfiguration(profile);
+        }
+    }
+    if (isDeviceTrusted) {
+        //Only used if we end up being the client, servers ignore it
+        QMutexLocker locker(&s_handshakeMutex);
+        sslConfig.setSessionTicket(s_sessionTickets.value(deviceId));
+    }
     socket->setSslConfiguration(sslConfig);
-    socket->setLocalCertificate(KdeConnectConfig::instance()->certificate());
-    socket->setPrivateKey(KdeConnectConfig::instance()->privateKeyPath());
     socket->setPeerVerifyName(deviceId);
 
-    if (isDeviceTrusted) {
-        QString certString = KdeConnectConfig::instance()->getDeviceProperty(deviceId, QStringLiteral("certificate"), QString());
-        socket->addCaCertificate(QSslCertificate(certString.toLatin1()));
-        socket->setPeerVerifyMode(QSslSocket::VerifyPeer);
+    //Time the handshakes, from the TCP connection (or now, if it's already connected) until it's encrypted
+    QSharedPointer<QElapsedTimer> handshakeTimer(new QElapsedTimer);
+    if (socket->state() == QAbstractSocket::ConnectedState) {
+        handshakeTimer->start();
     } else {
-        socket->setPeerVerifyMode(QSslSocket::QueryPeer);
+        QObject::connect(socket, &QAbstractSocket::connected, socket, [handshakeTimer]() {
+            handshakeTimer->start();
+        });
     }
+    const bool offeredTicket = isDeviceTrusted && !socket->sslConfiguration().sessionTicket().isEmpty();
+    QObject::connect(socket, &QSslSocket::encrypted, socket, [socket, deviceId, isDeviceTrusted, offeredTicket, handshakeTimer]() {
+        const qint64 elapsed = handshakeTimer->isValid()? handshakeTimer->elapsed() : 0;
+        QMutexLocker locker(&s_handshakeMutex);
+        s_handshakeStatistics.handshakes++;
+        s_handshakeStatistics.totalMsecs += elapsed;
+        if (offeredTicket && socket->mode() == QSslSocket::SslClientMode) {
+            s_handshakeStatistics.withTicket++;
+        }
+        qCDebug(KDECONNECT_CORE) << "TLS handshake with" << deviceId << "took" << elapsed << "ms,"
+                                 << (socket->mode() == QSslSocket::SslClientMode? "as client" : "as server")
+                                 << (offeredTicket? "with a session ticket" : "without a session ticket")
+                                 << "using" << socket->sessionCipher().name()
+                                 << "- average" << s_handshakeStatistics.totalMsecs / s_handshakeStatistics.handshakes << "ms over"
+                                 << s_handshakeStatistics.handshakes << "handshakes," << s_handshakeStatistics.withTicket << "of them resumable";
+        locker.unlock();
+
+        if (isDeviceTrusted) {
+            rememberSessionTicket(socket, deviceId);
+        }
+    });
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    //With TLS 1.3 the ticket comes after the handshake
+    if (isDeviceTrusted) {
+        QObject::connect(socket, &QSslSocket::newSessionTicketReceived, socket, [socket, deviceId]() {
+            rememberSessionTicket(socket, deviceId);
+        });
+    }
+#endif
 
     //Usually SSL errors are only bad for trusted devices. Uncomment this section to log errors in any case, for debugging.
     //QObject::connect(socket, static_cast<void (QSslSocket::*)(const QList<QSslError>&)>(&QSslSocket::sslErrors), [](const QList<QSslError>& errors)
@@ -506,6 +1140,17 @@ void LanLinkProvider::addLink(const QString& deviceId, QSslSocket* socket, Netwo
             m_pairingHandlers[deviceId]->setDeviceLink(deviceLink);
         }
     }
+    m_linkedSince[deviceId] = m_clock.elapsed();
+
+    //Where to look for it first next time, see probeKnownDevices()
+    KdeConnectConfig* config = KdeConnectConfig::instance();
+    if (config->trustedDevices().contains(deviceId)) {
+        const QString address = deviceLink->hostAddress().toString();
+        if (address != config->getDeviceProperty(deviceId, QStringLiteral("lastKnownAddress"))) {
+            config->setDeviceProperty(deviceId, QStringLiteral("lastKnownAddress"), address);
+        }
+    }
+    deviceLink->setPeerIdentity(*receivedPacket);
     Q_EMIT onConnectionReceived(*receivedPacket, deviceLink);
 }
 
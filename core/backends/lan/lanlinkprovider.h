@@ -22,6 +22,9 @@
 #define LANLINKPROVIDER_H
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QQueue>
 #include <QTcpServer>
 #include <QSslSocket>
 #include <QUdpSocket>
@@ -35,6 +38,7 @@
 #include "landevicelink.h"
 
 class LanPairingHandler;
+class LanLinkWorker;
 class KDECONNECTCORE_EXPORT LanLinkProvider
     : public LinkProvider
 {
@@ -51,13 +55,51 @@ public:
     void userRequestsUnpair(const QString& deviceId);
     void incomingPairPacket(DeviceLink* device, const NetworkPacket& np);
 
+    //LegacySslProfile is TLS 1.0 with the ciphers old Android versions support, ModernSslProfile is
+    //TLS 1.2 or later with AEAD ciphers only, for peers with "modern" in the tlsProfiles of their identity
+    enum SslProfile { LegacySslProfile, ModernSslProfile };
+
     static void configureSslSocket(QSslSocket* socket, const QString& deviceId, bool isDeviceTrusted);
+    //Remembers the profile a device supports, configureSslSocket uses it for every socket to that device
+    static void setPeerSslProfile(const QString& deviceId, const NetworkPacket& identityPacket);
+    static void setPeerSslProfile(const QString& deviceId, SslProfile profile);
+    static SslProfile sslProfile(const QString& deviceId);
+    //Forgets the configuration built for a trusted device, connected to KdeConnectConfig::deviceTrustChanged
+    static void clearSslConfigurationCache(const QString& deviceId);
     static void configureSocket(QSslSocket* socket);
 
     const static quint16 UDP_PORT = 1716;
     const static quint16 MIN_TCP_PORT = 1716;
     const static quint16 MAX_TCP_PORT = 1764;
 
+    //Handshakes that can be pending at once (connections in progress and announcements waiting for one)
+    //and how long one can take before we give up on it
+    const static int MAX_PENDING_HANDSHAKES = 64;
+    const static int HANDSHAKE_TIMEOUT_MSECS = 15000;
+    //Announcements accepted from a single address: a burst of ANNOUNCEMENT_BURST, then ANNOUNCEMENTS_PER_SECOND
+    const static int ANNOUNCEMENT_BURST = 5;
+    const static int ANNOUNCEMENTS_PER_SECOND = 1;
+    //Announcements from a device we (re)connected to less than this ago, from the address of its link, are ignored
+    const static int RECONNECT_DEBOUNCE_MSECS = 10000;
+
+    void setHandshakeLimits(int maxPending, int timeoutMsecs);
+    void setAnnouncementRateLimit(int burst, int perSecond);
+    void setReconnectDebounce(int msecs);
+
+    //What happened to the UDP announcements we got, to see how the limits hold up under a broadcast storm
+    struct HandshakeCounters {
+        quint64 announcements = 0; //Identity packets from other devices
+        quint64 accepted = 0;      //We connected (or will connect) to them
+        quint64 linked = 0;        //Dropped, the device has a link that was set up a moment ago
+        quint64 duplicates = 0;    //Dropped, there was a handshake with the device pending already
+        quint64 rateLimited = 0;   //Dropped, their address sent too many
+        quint64 tableFull = 0;     //Dropped (or incoming connections closed), there were MAX_PENDING_HANDSHAKES pending
+        quint64 timedOut = 0;      //Handshakes (in both directions) we gave up on
+        quint64 malformed = 0;     //Datagrams that weren't identity packets
+    };
+    HandshakeCounters handshakeCounters() const { return m_handshakeCounters; }
+    int pendingHandshakes() const { return m_receivedIdentityPackets.size() + m_queuedAnnouncements.size(); }
+
 public Q_SLOTS:
     void onNetworkChange() override;
     void onStart() override;
@@ -68,10 +110,15 @@ public Q_SLOTS:
 
 private Q_SLOTS:
     void newUdpConnection();
+    void startQueuedConnections();
+    void identitySent();
+    void handshakeDisconnected();
+    void abortExpiredHandshakes();
     void newConnection();
+    void incomingDisconnected();
     void dataReceived();
     void deviceLinkDestroyed(QObject* destroyedDeviceLink);
-    void sslErrors(const QList<QSslError>& errors);
+    void sslErrors(const QList<QSslError>& errors, const QString& peerVerifyName);
     void broadcastToNetwork();
 
 private:
@@ -79,19 +126,54 @@ private:
 
     void onNetworkConfigurationChanged(const QNetworkConfiguration& config);
     void addLink(const QString& deviceId, QSslSocket* socket, NetworkPacket* receivedPacket, LanDeviceLink::ConnectionStarted connectionOrigin);
+    void identityExchangeFinished(QSslSocket* socket);
+    void removePendingConnection(QSslSocket* socket);
+    void startEncryption(QSslSocket* socket, const QString& deviceId, QSslSocket::SslMode mode);
+    QSslSocket* handshakeSocket(QObject* worker) const;
+    bool isHandshakePending(const QString& deviceId) const;
+    bool isRecentlyLinked(const QString& deviceId, const QHostAddress& sender) const;
+    bool admitAnnouncement(const QHostAddress& sender);
+    void probeKnownDevices(const QByteArray& identity);
+    QUdpSocket& udpSocketFor(const QHostAddress& address);
+    const QByteArray& serializedIdentityPacket();
 
     Server* m_server;
     QUdpSocket m_udpSocket;
+    QUdpSocket m_udp6Socket; //IPv6 link-local multicast, where the system has IPv6
     quint16 m_tcpPort;
+    //Our identity packet (including tcpPort) as sent over the wire, rebuilt on the next network change
+    QByteArray m_serializedIdentity;
 
     QMap<QString, LanDeviceLink*> m_links;
     QMap<QString, LanPairingHandler*> m_pairingHandlers;
 
+    enum HandshakeState { Connecting, SendingIdentity, Encrypting };
     struct PendingConnect {
-        NetworkPacket* np;
+        NetworkPacket* np = nullptr;
         QHostAddress sender;
+        HandshakeState state = Encrypting; //Connections started by the other end only go through this one
+        LanLinkWorker* worker = nullptr; //Once the TLS handshake starts
+        QElapsedTimer age;
     };
     QMap<QSslSocket*, PendingConnect> m_receivedIdentityPackets;
+    //Announcements waiting for one of the MAX_CONCURRENT_HANDSHAKES slots, and how many of them are taken
+    QQueue<PendingConnect> m_queuedAnnouncements;
+    int m_identityHandshakes;
+    int m_maxPendingHandshakes;
+    int m_handshakeTimeout;
+    QTimer m_handshakeTimeoutTimer;
+
+    struct AnnouncementBudget {
+        int tokens;
+        qint64 refilled; //m_clock time the tokens were last topped up
+    };
+    QHash<QHostAddress, AnnouncementBudget> m_announcementBudgets;
+    int m_announcementBurst;
+    int m_announcementsPerSecond;
+    QElapsedTimer m_clock;
+    HandshakeCounters m_handshakeCounters;
+    int m_reconnectDebounce;
+    QHash<QString, qint64> m_linkedSince; //m_clock time each link was last (re)connected
     QNetworkConfiguration m_lastConfig;
     const bool m_testMode;
     QTimer m_combineBroadcastsTimer;
@@ -0,0 +1,261 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lanlinkworker.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+#include "core_debug.h"
+#include "landevicelink.h"
+#include "socketlinereader.h"
+
+//Handshakes and decoding for several devices can run at the same time, but a handful of threads is plenty
+static const int MAX_IO_THREADS = 4;
+
+namespace {
+//Only used from the main thread
+class IoThreads
+{
+public:
+    ~IoThreads()
+    {
+        for (QThread* thread : qAsConst(m_threads)) {
+            thread->quit();
+            thread->wait();
+            delete thread;
+        }
+    }
+
+    int size() const
+    {
+        return qBound(1, QThread::idealThreadCount(), MAX_IO_THREADS);
+    }
+
+    //Links are handed out round robin, each of them stays in its thread for its whole life
+    QThread* next()
+    {
+        if (m_threads.size() < size()) {
+            QThread* thread = new QThread;
+            thread->setObjectName(QStringLiteral("KDE Connect I/O %1").arg(m_threads.size()));
+            thread->start();
+            m_threads.append(thread);
+            return thread;
+        }
+        m_next = (m_next + 1) % m_threads.size();
+        return m_threads.at(m_next);
+    }
+
+private:
+    QVector<QThread*> m_threads;
+    int m_next = 0;
+};
+}
+
+Q_GLOBAL_STATIC(IoThreads, s_ioThreads)
+
+int LanLinkWorker::threadCount()
+{
+    return s_ioThreads->size();
+}
+
+LanLinkWorker* LanLinkWorker::adopt(QSslSocket* socket)
+{
+    LanLinkWorker* worker = qobject_cast<LanLinkWorker*>(socket->parent());
+    if (worker) {
+        return worker;
+    }
+    Q_ASSERT(socket->thread() == QThread::currentThread());
+    worker = new LanLinkWorker(socket);
+    //We may be in a slot connected to one of the socket's signals, and QAbstractSocket still uses the socket
+    //when it returns. Calls queued before the move go with the worker to the I/O thread.
+    QMetaObject::invokeMethod(worker, "moveToIoThread", Qt::QueuedConnection);
+    return worker;
+}
+
+LanLinkWorker::LanLinkWorker(QSslSocket* socket)
+    : QObject(nullptr)
+    , m_socket(socket)
+    , m_socketLineReader(new SocketLineReader(socket, this))
+    , m_peerAddress(socket->peerAddress())
+    , m_started(false)
+    , m_peerCertificate(socket->peerCertificate())
+    , m_sslMode(socket->mode())
+    , m_connected(socket->state() == QAbstractSocket::ConnectedState)
+{
+    //Moves with us to the worker thread
+    socket->setParent(this);
+
+    connect(socket, &QSslSocket::encrypted, this, &LanLinkWorker::socketEncrypted);
+    connect(socket, static_cast<void (QSslSocket::*)(const QList<QSslError>&)>(&QSslSocket::sslErrors),
+            this, &LanLinkWorker::socketSslErrors);
+    connect(socket, &QAbstractSocket::disconnected, this, &LanLinkWorker::socketDisconnected);
+    connect(socket, &QIODevice::bytesWritten, this, &LanLinkWorker::bytesWritten);
+    connect(socket, &QObject::destroyed, this, &QObject::deleteLater);
+    connect(m_socketLineReader, &SocketLineReader::readyRead, this, &LanLinkWorker::dataReceived);
+}
+
+QSslCertificate LanLinkWorker::peerCertificate() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_peerCertificate;
+}
+
+QSslSocket::SslMode LanLinkWorker::sslMode() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_sslMode;
+}
+
+bool LanLinkWorker::isConnected() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_connected;
+}
+
+void LanLinkWorker::moveToIoThread()
+{
+    moveToThread(s_ioThreads->next());
+}
+
+void LanLinkWorker::startClientEncryption()
+{
+    QMetaObject::invokeMethod(m_socket, "startClientEncryption", Qt::QueuedConnection);
+}
+
+void LanLinkWorker::startServerEncryption()
+{
+    QMetaObject::invokeMethod(m_socket, "startServerEncryption", Qt::QueuedConnection);
+}
+
+void LanLinkWorker::start()
+{
+    QMetaObject::invokeMethod(this, "doStart", Qt::QueuedConnection);
+}
+
+void LanLinkWorker::write(const QByteArray& data)
+{
+    QMetaObject::invokeMethod(this, "doWrite", Qt::QueuedConnection, Q_ARG(QByteArray, data));
+}
+
+void LanLinkWorker::abort()
+{
+    QMetaObject::invokeMethod(this, "doAbort", Qt::QueuedConnection);
+}
+
+QVector<LanLinkWorker::Received> LanLinkWorker::takeReceived()
+{
+    QMutexLocker locker(&m_mutex);
+    QVector<Received> received;
+    received.swap(m_received);
+    return received;
+}
+
+void LanLinkWorker::socketEncrypted()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_peerCertificate = m_socket->peerCertificate();
+        m_sslMode = m_socket->mode();
+    }
+    Q_EMIT encrypted();
+}
+
+void LanLinkWorker::socketSslErrors(const QList<QSslError>& errors)
+{
+    Q_EMIT sslErrors(errors, m_socket->peerVerifyName());
+}
+
+void LanLinkWorker::socketDisconnected()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_connected = false;
+    }
+    Q_EMIT disconnected();
+}
+
+void LanLinkWorker::doStart()
+{
+    m_started = true;
+    dataReceived();
+}
+
+void LanLinkWorker::doWrite(const QByteArray& data)
+{
+    if (m_socket->write(data) == -1) {
+        qCWarning(KDECONNECT_CORE) << "Failed to write" << data.size() << "bytes to" << m_peerAddress;
+        QMutexLocker locker(&m_mutex);
+        m_connected = false;
+    }
+}
+
+void LanLinkWorker::doAbort()
+{
+    m_socket->abort();
+}
+
+void LanLinkWorker::dataReceived()
+{
+    if (!m_started) {
+        return; //Stays in the reader until start()
+    }
+
+    QVector<Received> frames;
+    while (m_socketLineReader->bytesAvailable() > 0) {
+        //Only valid until we return to the event loop, unserialize() copies what it needs
+        const QByteArray serializedPacket = m_socketLineReader->readLineInPlace();
+        Received item;
+        bool success;
+        if (SocketLineReader::isBinaryFrameType(serializedPacket.at(0))) {
+            const QByteArray framePayload = QByteArray::fromRawData(serializedPacket.constData() + 1, serializedPacket.size() - 1);
+            if (serializedPacket.at(0) == LanDeviceLink::CborFrame) {
+                success = NetworkPacket::unserialize(framePayload, &item.packet);
+            } else if (serializedPacket.at(0) == LanDeviceLink::DeflateFrame) {
+                //unserialize() tells JSON and CBOR apart by itself
+                const QByteArray encodedPacket = LanDeviceLink::uncompressPacket(framePayload);
+                success = !encodedPacket.isNull() && NetworkPacket::unserialize(encodedPacket, &item.packet);
+            } else if (serializedPacket.at(0) == LanDeviceLink::PayloadFrame) {
+                item.payloadChunk = QByteArray(framePayload.constData(), framePayload.size());
+                success = true;
+            } else {
+                qCWarning(KDECONNECT_CORE) << "Ignoring binary frame of unknown type" << int(serializedPacket.at(0));
+                success = false;
+            }
+        } else {
+            success = NetworkPacket::unserialize(serializedPacket, &item.packet);
+        }
+
+        if (success) {
+            frames.append(item);
+        }
+    }
+
+    if (frames.isEmpty()) {
+        return;
+    }
+    QMutexLocker locker(&m_mutex);
+    const bool wasEmpty = m_received.isEmpty();
+    m_received += frames;
+    locker.unlock();
+    if (wasEmpty) {
+        Q_EMIT received();
+    }
+}
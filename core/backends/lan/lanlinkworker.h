@@ -0,0 +1,118 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LANLINKWORKER_H
+#define LANLINKWORKER_H
+
+#include <QObject>
+#include <QHostAddress>
+#include <QList>
+#include <QMutex>
+#include <QSslCertificate>
+#include <QSslError>
+#include <QSslSocket>
+#include <QVector>
+
+#include <kdeconnectcore_export.h>
+#include "networkpacket.h"
+
+class SocketLineReader;
+
+/*
+ * Owns the socket of a LanDeviceLink and does everything that touches it in one of a few I/O threads:
+ * the TLS handshake, decrypting and encrypting, splitting frames and unserializing packets. The main
+ * thread only sees whole packets, through takeReceived().
+ *
+ * Workers are created and driven from the main thread. The public methods that act on the socket only
+ * queue the call for the worker thread, the getters return what was captured when it was safe to.
+ */
+class KDECONNECTCORE_EXPORT LanLinkWorker
+    : public QObject
+{
+    Q_OBJECT
+
+public:
+    //A packet, or a chunk of a payload that comes through the link itself
+    struct Received {
+        Received() : packet(QString()) {}
+        NetworkPacket packet;
+        QByteArray payloadChunk; //Only set for chunks
+    };
+
+    //Puts @p socket under a new worker, or returns the worker it already belongs to. The worker takes
+    //ownership of the socket, and deletes itself if the socket goes away first. Both move to an I/O
+    //thread once control returns to the event loop, so this can be called from the socket's own slots.
+    static LanLinkWorker* adopt(QSslSocket* socket);
+
+    QSslSocket* socket() const { return m_socket; }
+    QHostAddress peerAddress() const { return m_peerAddress; }
+    QSslCertificate peerCertificate() const;
+    QSslSocket::SslMode sslMode() const;
+    //False once the socket is disconnected or can't be written to anymore
+    bool isConnected() const;
+
+    void startClientEncryption();
+    void startServerEncryption();
+    //Nothing is read from the socket until this is called, so no packet is lost before there's someone to get it
+    void start();
+    void write(const QByteArray& data);
+    //Drops the connection, disconnected() follows
+    void abort();
+    //Everything received since the last call, in the order it arrived. Thread safe.
+    QVector<Received> takeReceived();
+
+    static int threadCount();
+
+Q_SIGNALS:
+    void encrypted();
+    //With the name the socket verified the peer against, which can't be asked from the main thread
+    void sslErrors(const QList<QSslError>& errors, const QString& peerVerifyName);
+    void disconnected();
+    //There's something for takeReceived(), it isn't emitted again until it's been called
+    void received();
+    void bytesWritten(qint64 bytes);
+
+private Q_SLOTS:
+    void socketEncrypted();
+    void socketSslErrors(const QList<QSslError>& errors);
+    void socketDisconnected();
+    void dataReceived();
+    void doStart();
+    void moveToIoThread();
+    void doWrite(const QByteArray& data);
+    void doAbort();
+
+private:
+    explicit LanLinkWorker(QSslSocket* socket);
+
+    QSslSocket* m_socket;
+    SocketLineReader* m_socketLineReader;
+    const QHostAddress m_peerAddress;
+    bool m_started;
+
+    //Written in the worker thread, read from the main thread
+    mutable QMutex m_mutex;
+    QSslCertificate m_peerCertificate;
+    QSslSocket::SslMode m_sslMode;
+    bool m_connected;
+    QVector<Received> m_received;
+};
+
+#endif
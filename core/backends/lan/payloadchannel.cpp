@@ -0,0 +1,254 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "payloadchannel.h"
+
+#include <QtEndian>
+
+#include "core_debug.h"
+
+static const int CHUNK_HEADER_SIZE = 4; //32 bit stream id
+
+//The receiving end of a stream, it's what plugins get as the payload of the packet
+class PayloadStream
+    : public QIODevice
+{
+public:
+    explicit PayloadStream(qint64 size)
+        : m_size(size)
+        , m_remaining(size)
+        , m_readPos(0)
+        , m_finished(false)
+    {
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    }
+
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override { return m_buffer.size() - m_readPos + QIODevice::bytesAvailable(); }
+    bool atEnd() const override { return m_finished && bytesAvailable() == 0; }
+
+    //Bytes the sender announced, and the ones it still has to send
+    qint64 announcedSize() const { return m_size; }
+    qint64 remaining() const { return m_remaining; }
+
+    void append(const char* data, int size)
+    {
+        m_remaining -= size;
+        if (m_readPos > 0 && m_readPos == m_buffer.size()) {
+            m_buffer.resize(0);
+            m_readPos = 0;
+        }
+        m_buffer.append(data, size);
+        Q_EMIT readyRead();
+    }
+
+    void finish()
+    {
+        if (m_finished) {
+            return;
+        }
+        m_finished = true;
+        Q_EMIT readChannelFinished();
+    }
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override
+    {
+        const qint64 size = qMin<qint64>(maxSize, m_buffer.size() - m_readPos);
+        if (size == 0) {
+            return m_finished? -1 : 0;
+        }
+        memcpy(data, m_buffer.constData() + m_readPos, size);
+        m_readPos += size;
+        //Don't keep what was already read around forever if the reader is slower than the network
+        if (m_readPos >= 1024 * 1024 && m_readPos * 2 > m_buffer.size()) {
+            m_buffer.remove(0, m_readPos);
+            m_readPos = 0;
+        }
+        return size;
+    }
+
+    qint64 writeData(const char*, qint64) override { return -1; }
+
+private:
+    const qint64 m_size;
+    qint64 m_remaining;
+    QByteArray m_buffer;
+    int m_readPos;
+    bool m_finished;
+};
+
+PayloadChannel::PayloadChannel(QObject* parent)
+    : QObject(parent)
+    , m_nextOutgoing(0)
+    , m_lastStreamId(0)
+    , m_outgoingSize(0)
+    , m_incomingSize(0)
+{
+}
+
+PayloadChannel::~PayloadChannel()
+{
+    //Whoever is reading a stream we won't complete shouldn't wait for it forever
+    for (const QSharedPointer<PayloadStream>& stream : qAsConst(m_incoming)) {
+        stream->finish();
+    }
+}
+
+QByteArray PayloadChannel::chunk(quint32 streamId, const QByteArray& data)
+{
+    QByteArray chunk(CHUNK_HEADER_SIZE, Qt::Uninitialized);
+    qToBigEndian<quint32>(streamId, reinterpret_cast<uchar*>(chunk.data()));
+    chunk.append(data);
+    return chunk;
+}
+
+bool PayloadChannel::canAddOutgoing(qint64 size) const
+{
+    return fits(size) && m_outgoing.size() < MAX_STREAMS && m_outgoingSize + size <= MAX_PENDING_SIZE;
+}
+
+quint32 PayloadChannel::addOutgoing(const QSharedPointer<QIODevice>& source, qint64 size)
+{
+    Q_ASSERT(canAddOutgoing(size));
+
+    if (!source->isOpen() && !source->open(QIODevice::ReadOnly)) {
+        qCWarning(KDECONNECT_CORE) << "error when opening the input to upload";
+    }
+
+    Outgoing stream;
+    stream.id = ++m_lastStreamId;
+    stream.source = source;
+    stream.size = size;
+    stream.remaining = size;
+    stream.sourceClosed = !source->isOpen();
+    m_outgoing.append(stream);
+    m_outgoingSize += size;
+
+    //Sequential sources (eg: a process) may not have everything yet
+    connect(source.data(), &QIODevice::readyRead, this, &PayloadChannel::dataPending);
+    const quint32 id = stream.id;
+    connect(source.data(), &QIODevice::readChannelFinished, this, [this, id]() {
+        for (Outgoing& outgoing : m_outgoing) {
+            if (outgoing.id == id) {
+                outgoing.sourceClosed = true;
+            }
+        }
+        Q_EMIT dataPending();
+    });
+
+    Q_EMIT dataPending();
+    return stream.id;
+}
+
+QByteArray PayloadChannel::nextChunk()
+{
+    for (int tried = 0; tried < m_outgoing.size(); ++tried) {
+        if (m_nextOutgoing >= m_outgoing.size()) {
+            m_nextOutgoing = 0;
+        }
+        Outgoing& stream = m_outgoing[m_nextOutgoing];
+
+        qint64 toRead = CHUNK_SIZE;
+        if (stream.remaining >= 0) {
+            toRead = qMin(toRead, stream.remaining);
+        }
+        const QByteArray data = (toRead > 0 && stream.source->isOpen())? stream.source->read(toRead) : QByteArray();
+        if (!data.isEmpty()) {
+            if (stream.remaining > 0) {
+                stream.remaining -= data.size();
+            }
+            ++m_nextOutgoing;
+            return chunk(stream.id, data);
+        }
+
+        const bool ended = stream.remaining == 0
+                        || !stream.source->isOpen()
+                        || (stream.source->atEnd() && (!stream.source->isSequential() || stream.sourceClosed));
+        if (ended) {
+            if (stream.remaining > 0) {
+                qCWarning(KDECONNECT_CORE) << "Payload ended" << stream.remaining << "bytes before its announced size";
+            }
+            const quint32 id = stream.id;
+            disconnect(stream.source.data(), nullptr, this, nullptr);
+            stream.source->close();
+            m_outgoingSize -= stream.size;
+            m_outgoing.removeAt(m_nextOutgoing);
+            return chunk(id, QByteArray());
+        }
+
+        //Nothing available from this one right now, we'll hear from it through dataPending
+        ++m_nextOutgoing;
+    }
+    return QByteArray();
+}
+
+QSharedPointer<QIODevice> PayloadChannel::addIncoming(quint32 streamId, qint64 size)
+{
+    //Whatever we receive is kept in memory until it's read, and nothing stops the sender
+    if (!fits(size)) {
+        qCWarning(KDECONNECT_CORE) << "Refusing payload stream" << streamId << "of size" << size;
+        return QSharedPointer<QIODevice>();
+    }
+    if (m_incoming.contains(streamId)) {
+        qCWarning(KDECONNECT_CORE) << "Refusing payload stream" << streamId << "while the stream with that id is still in flight";
+        return QSharedPointer<QIODevice>();
+    }
+    if (m_incoming.size() >= MAX_STREAMS || m_incomingSize + size > MAX_PENDING_SIZE) {
+        qCWarning(KDECONNECT_CORE) << "Refusing payload stream" << streamId << "with" << m_incoming.size()
+                                   << "streams and" << m_incomingSize << "bytes in flight already";
+        return QSharedPointer<QIODevice>();
+    }
+
+    QSharedPointer<PayloadStream> stream(new PayloadStream(size));
+    m_incoming.insert(streamId, stream);
+    m_incomingSize += size;
+    return stream.staticCast<QIODevice>();
+}
+
+void PayloadChannel::removeIncoming(quint32 streamId)
+{
+    const QSharedPointer<PayloadStream> stream = m_incoming.take(streamId);
+    m_incomingSize -= stream->announcedSize();
+    stream->finish();
+}
+
+void PayloadChannel::receiveChunk(const QByteArray& chunk)
+{
+    if (chunk.size() < CHUNK_HEADER_SIZE) {
+        qCWarning(KDECONNECT_CORE) << "Ignoring truncated payload chunk";
+        return;
+    }
+    const quint32 streamId = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(chunk.constData()));
+    const QSharedPointer<PayloadStream> stream = m_incoming.value(streamId);
+    if (!stream) {
+        qCWarning(KDECONNECT_CORE) << "Ignoring payload chunk for unknown stream" << streamId;
+        return;
+    }
+
+    if (chunk.size() == CHUNK_HEADER_SIZE) {
+        removeIncoming(streamId);
+    } else if (chunk.size() - CHUNK_HEADER_SIZE > stream->remaining()) {
+        qCWarning(KDECONNECT_CORE) << "Payload stream" << streamId << "is bigger than announced, ending it";
+        removeIncoming(streamId);
+    } else {
+        stream->append(chunk.constData() + CHUNK_HEADER_SIZE, chunk.size() - CHUNK_HEADER_SIZE);
+    }
+}
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAYLOADCHANNEL_H
+#define PAYLOADCHANNEL_H
+
+#include <QObject>
+#include <QHash>
+#include <QIODevice>
+#include <QList>
+#include <QSharedPointer>
+
+#include "kdeconnectcore_export.h"
+
+class PayloadStream;
+
+/*
+ * Multiplexes payloads over the connection a LanDeviceLink already has, so small payloads
+ * don't need a listening port, a new connection and a TLS handshake each.
+ *
+ * Every payload is a stream with an id that is sent in the payloadTransferInfo of its packet.
+ * Its data is split in chunks: the stream id as a 32 bit big endian integer followed by up to
+ * CHUNK_SIZE bytes of data. A chunk without data ends the stream. The link is in charge of
+ * framing the chunks and of asking for the next one when the socket has room for it.
+ *
+ * There's no flow control: the receiver keeps what arrives in memory until it's read. So only
+ * payloads of a known size up to MAX_STREAM_SIZE go through here, and at most MAX_STREAMS of them
+ * adding up to MAX_PENDING_SIZE can be in flight at once. The sender sends anything beyond that
+ * through its own connection, a receiver that is asked for more drops the link.
+ */
+class KDECONNECTCORE_EXPORT PayloadChannel
+    : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit PayloadChannel(QObject* parent = nullptr);
+    ~PayloadChannel() override;
+
+    //Sending side: the returned id goes in the payloadTransferInfo of the packet
+    quint32 addOutgoing(const QSharedPointer<QIODevice>& source, qint64 size);
+    //Next chunk to send, taking turns between the streams. Null when none of them has data right now.
+    QByteArray nextChunk();
+    bool hasOutgoing() const { return !m_outgoing.isEmpty(); }
+    //Whether a payload of this size can be sent without going over what the receiver accepts
+    bool canAddOutgoing(qint64 size) const;
+
+    //Receiving side: the device gets the data of the stream as its chunks arrive.
+    //Null if the size isn't one we accept, the stream id is in use or there are too many streams in flight.
+    QSharedPointer<QIODevice> addIncoming(quint32 streamId, qint64 size);
+    void receiveChunk(const QByteArray& chunk);
+
+    static const int CHUNK_SIZE = 64 * 1024;
+    static const int MAX_STREAM_SIZE = 16 * 1024 * 1024;
+    static const int MAX_STREAMS = 8;
+    static const int MAX_PENDING_SIZE = 32 * 1024 * 1024;
+    static bool fits(qint64 payloadSize) { return payloadSize >= 0 && payloadSize <= MAX_STREAM_SIZE; }
+
+Q_SIGNALS:
+    //An outgoing stream has new data to send
+    void dataPending();
+
+private:
+    struct Outgoing {
+        quint32 id;
+        QSharedPointer<QIODevice> source;
+        qint64 size;
+        qint64 remaining; //-1 for endless streams
+        bool sourceClosed;
+    };
+
+    static QByteArray chunk(quint32 streamId, const QByteArray& data);
+    void removeIncoming(quint32 streamId);
+
+    QList<Outgoing> m_outgoing;
+    int m_nextOutgoing;
+    quint32 m_lastStreamId;
+    //Announced sizes of the streams in flight, the receiver counts the same ones since it sees the chunks in order
+    qint64 m_outgoingSize;
+    QHash<quint32, QSharedPointer<PayloadStream>> m_incoming;
+    qint64 m_incomingSize;
+};
+
+#endif
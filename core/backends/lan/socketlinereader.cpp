@@ -20,34 +20,151 @@
  */
 
 #include "socketlinereader.h"
+#include "core_debug.h"
+
+#include <QtEndian>
+
+#include <cstring>
+
+//Most packets are way smaller than this, so the buffer rarely has to grow
+static const int INITIAL_BUFFER_SIZE = 16 * 1024;
 
 SocketLineReader::SocketLineReader(QSslSocket* socket, QObject* parent)
     : QObject(parent)
     , m_socket(socket)
+    , m_readPos(0)
+    , m_scanPos(0)
+    , m_searchPos(0)
+    , m_nextFrame(0)
 {
+    m_buffer.reserve(INITIAL_BUFFER_SIZE);
     connect(m_socket, &QIODevice::readyRead,
             this, &SocketLineReader::dataReceived);
 }
 
-void SocketLineReader::dataReceived()
+static const int BINARY_FRAME_HEADER_SIZE = 5; //type byte + 32 bit length
+static const int MAX_BINARY_FRAME_SIZE = 256 * 1024 * 1024;
+//Read from the socket at once, at most
+static const int MAX_READ_SIZE = 1024 * 1024;
+
+QByteArray SocketLineReader::binaryFrame(char type, const QByteArray& payload)
 {
-    while (m_socket->canReadLine()) {
-        const QByteArray line = m_socket->readLine();
-        if (line.length() > 1) { //we don't want a single \n
-            m_packets.enqueue(line);
-        }
+    QByteArray frame;
+    frame.reserve(BINARY_FRAME_HEADER_SIZE + payload.size());
+    appendBinaryFrame(frame, type, payload);
+    return frame;
+}
+
+void SocketLineReader::appendBinaryFrame(QByteArray& out, char type, const QByteArray& payload)
+{
+    Q_ASSERT(isBinaryFrameType(type));
+    char header[BINARY_FRAME_HEADER_SIZE];
+    header[0] = type;
+    qToBigEndian<quint32>(payload.size(), reinterpret_cast<uchar*>(header + 1));
+    out.append(header, BINARY_FRAME_HEADER_SIZE);
+    out.append(payload);
+}
+
+QByteArray SocketLineReader::readLineInPlace()
+{
+    if (m_nextFrame >= m_frames.size()) {
+        return QByteArray();
     }
+    const Frame& frame = m_frames.at(m_nextFrame++);
+    m_readPos = frame.offset + frame.size;
+    return QByteArray::fromRawData(m_buffer.constData() + frame.offset, frame.size);
+}
 
-    //If we still have things to read from the socket, call dataReceived again
-    //We do this manually because we do not trust readyRead to be emitted again
-    //So we call this method again just in case.
-    if (m_socket->bytesAvailable() > 0) {
-        QMetaObject::invokeMethod(this, "dataReceived", Qt::QueuedConnection);
+//Drops what has already been read, so the buffer doesn't grow forever
+void SocketLineReader::compact()
+{
+    if (m_nextFrame == m_frames.size()) {
+        m_frames.resize(0);
+        m_nextFrame = 0;
+        m_readPos = m_scanPos;
+    }
+    if (m_readPos == 0) {
         return;
     }
 
+    const int removed = m_readPos;
+    m_buffer.remove(0, removed);
+    m_frames.remove(0, m_nextFrame);
+    m_nextFrame = 0;
+    for (Frame& frame : m_frames) {
+        frame.offset -= removed;
+    }
+    m_readPos = 0;
+    m_scanPos -= removed;
+    m_searchPos -= removed;
+}
+
+void SocketLineReader::dataReceived()
+{
+    compact();
+
+    //In bounded chunks, so the buffer size can't overflow however much the socket says it has
+    while (m_socket->bytesAvailable() > 0) {
+        const int oldSize = m_buffer.size();
+        const int chunkSize = int(qMin<qint64>(m_socket->bytesAvailable(), MAX_READ_SIZE));
+        m_buffer.resize(oldSize + chunkSize);
+        const qint64 read = m_socket->read(m_buffer.data() + oldSize, chunkSize);
+        m_buffer.resize(oldSize + int(qMax<qint64>(read, 0)));
+        if (read <= 0 || !scanFrames()) {
+            break;
+        }
+    }
+
     //If we have any packets, tell it to the world.
-    if (!m_packets.isEmpty()) {
+    if (bytesAvailable() > 0) {
         Q_EMIT readyRead();
     }
 }
+
+//Finds the complete frames in m_buffer[m_scanPos, end). Returns false if the connection was dropped.
+bool SocketLineReader::scanFrames()
+{
+    char* const data = m_buffer.data();
+    const int end = m_buffer.size();
+    while (m_scanPos < end) {
+        if (isBinaryFrameType(data[m_scanPos])) {
+            if (end - m_scanPos < BINARY_FRAME_HEADER_SIZE) {
+                break;
+            }
+            const quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data + m_scanPos + 1));
+            if (length > quint32(MAX_BINARY_FRAME_SIZE)) {
+                qCWarning(KDECONNECT_CORE) << "Binary frame too big, dropping connection" << length;
+                m_socket->abort();
+                return false;
+            }
+            if (end - m_scanPos - BINARY_FRAME_HEADER_SIZE < qint64(length)) {
+                break;
+            }
+            //Move the type byte next to the payload, over the last byte of the length we don't need anymore
+            const int typePos = m_scanPos + BINARY_FRAME_HEADER_SIZE - 1;
+            data[typePos] = data[m_scanPos];
+            m_frames.append({typePos, 1 + int(length)});
+            m_scanPos += BINARY_FRAME_HEADER_SIZE + int(length);
+            m_searchPos = m_scanPos;
+        } else {
+            const int searchFrom = qMax(m_scanPos, m_searchPos);
+            const char* newline = static_cast<const char*>(memchr(data + searchFrom, '\n', end - searchFrom));
+            if (!newline) {
+                m_searchPos = end;
+                if (end - m_scanPos > MAX_BINARY_FRAME_SIZE) {
+                    qCWarning(KDECONNECT_CORE) << "Line too long, dropping connection";
+                    m_socket->abort();
+                    return false;
+                }
+                break;
+            }
+            const int lineEnd = int(newline - data) + 1;
+            if (lineEnd - m_scanPos > 1) { //we don't want a single \n
+                m_frames.append({m_scanPos, lineEnd - m_scanPos});
+            }
+            m_scanPos = lineEnd;
+            m_searchPos = m_scanPos;
+        }
+    }
+    return true;
+}
@@ -22,7 +22,7 @@
 #define SOCKETLINEREADER_H
 
 #include <QObject>
-#include <QQueue>
+#include <QVector>
 #include <QSslSocket>
 #include <QHostAddress>
 
@@ -31,6 +31,14 @@
 /*
  * Encapsulates a QTcpSocket and implements the same methods of its API that are
  * used by LanDeviceLink, but readyRead is emitted only when a newline is found.
+ *
+ * Besides newline terminated lines, the stream can carry binary frames: a frame type
+ * byte below 0x20 (never the first byte of a JSON line), the payload length as a
+ * 32 bit big endian integer and the payload. readLine() returns a binary frame as its
+ * type byte followed by the payload.
+ *
+ * Everything the socket has is read into a single buffer and split into frames with one
+ * scan, frames are then handed out as slices of that buffer.
  */
 class KDECONNECTCORE_EXPORT SocketLineReader
     : public QObject
@@ -40,11 +48,18 @@ class KDECONNECTCORE_EXPORT SocketLineReader
 public:
     explicit SocketLineReader(QSslSocket* socket, QObject* parent = nullptr);
 
-    QByteArray readLine() { return m_packets.dequeue(); }
+    QByteArray readLine() { const QByteArray line = readLineInPlace(); return QByteArray(line.constData(), line.size()); }
+    //Like readLine(), but without copying: the returned data points into our buffer and is only valid
+    //until control returns to the event loop, which is when more data can be read from the socket.
+    QByteArray readLineInPlace();
     qint64 write(const QByteArray& data) { return m_socket->write(data); }
     QHostAddress peerAddress() const { return m_socket->peerAddress(); }
     QSslCertificate peerCertificate() const { return m_socket->peerCertificate(); }
-    qint64 bytesAvailable() const { return m_packets.size(); }
+    qint64 bytesAvailable() const { return m_frames.size() - m_nextFrame; }
+
+    static bool isBinaryFrameType(char type) { return static_cast<uchar>(type) < 0x20 && type != '\n' && type != '\r' && type != '\t'; }
+    static QByteArray binaryFrame(char type, const QByteArray& payload);
+    static void appendBinaryFrame(QByteArray& out, char type, const QByteArray& payload);
 
     QSslSocket* m_socket;
     
@@ -55,8 +70,21 @@ private Q_SLOTS:
     void dataReceived();
 
 private:
-    QByteArray m_lastChunk;
-    QQueue<QByteArray> m_packets;
+    void compact();
+    bool scanFrames();
+
+    struct Frame {
+        int offset;
+        int size;
+    };
+
+    //m_buffer[m_readPos, m_scanPos) holds complete frames not read yet, m_buffer[m_scanPos, end) a partial one
+    QByteArray m_buffer;
+    int m_readPos;
+    int m_scanPos;
+    int m_searchPos; //Where to continue looking for the end of the partial line, so it's only scanned once
+    QVector<Frame> m_frames;
+    int m_nextFrame;
 
 };
 
@@ -21,23 +21,85 @@
 #include "uploadjob.h"
 
 #include <KLocalizedString>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <cmath>
+#include <limits>
 
 #include "lanlinkprovider.h"
 #include "kdeconnectconfig.h"
 #include "core_debug.h"
 
+//Bytes written per socket write, and how much we let the socket buffer before waiting for bytesWritten
+static const qint64 CHUNK_SIZE = 1024 * 1024;
+static const qint64 HIGH_WATER_MARK = 4 * 1024 * 1024;
+//How much of the start and of the end of a file goes into its content id
+static const qint64 CONTENT_ID_BLOCK_SIZE = 64 * 1024;
+
+//Size and modification time alone can match a different file (eg: a copy with preserved timestamps
+//that was edited in place), so a hash of the first and last blocks goes in too
+static QString contentIdFor(const QString& fileName)
+{
+    const QFileInfo fileInfo(fileName);
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QString();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(file.read(CONTENT_ID_BLOCK_SIZE));
+    if (fileInfo.size() > CONTENT_ID_BLOCK_SIZE) {
+        file.seek(qMax(CONTENT_ID_BLOCK_SIZE, fileInfo.size() - CONTENT_ID_BLOCK_SIZE));
+        hash.addData(file.read(CONTENT_ID_BLOCK_SIZE));
+    }
+    return QStringLiteral("%1-%2-%3").arg(fileInfo.size())
+                                     .arg(fileInfo.lastModified().toMSecsSinceEpoch())
+                                     .arg(QString::fromLatin1(hash.result().toHex()));
+}
+
+//The peer sends offsets and lengths as JSON numbers, which are doubles. Only whole numbers in [0, max] are
+//valid, checked before the conversion since converting a double that doesn't fit in a qint64 is undefined.
+static bool readRangeBound(const QJsonValue& value, qint64 max, qint64* bound)
+{
+    if (!value.isDouble()) {
+        return false;
+    }
+    const double number = value.toDouble();
+    //Also false for NaN and infinities
+    if (!(number >= 0 && number <= double(max) && number < -double(std::numeric_limits<qint64>::min()))) {
+        return false;
+    }
+    if (std::trunc(number) != number) {
+        return false;
+    }
+    *bound = qint64(number);
+    return *bound <= max;
+}
+
 UploadJob::UploadJob(const QSharedPointer<QIODevice>& source, const QString& deviceId)
     : KJob()
     , m_input(source)
     , m_server(new Server(this))
-    , m_socket(nullptr)
+    , m_streamCount(0)
     , m_port(0)
     , m_deviceId(deviceId) // We will use this info if link is on ssl, to send encrypted payload
+    , m_state(Idle)
+    , m_written(0)
 {
     connect(m_input.data(), &QIODevice::readyRead, this, &UploadJob::startUploading);
     connect(m_input.data(), &QIODevice::aboutToClose, this, &UploadJob::aboutToClose);
 }
 
+void UploadJob::setStreamCount(int streams, qint64 payloadSize)
+{
+    Q_ASSERT(m_state == Idle);
+    m_streamCount = (m_input->isSequential() || payloadSize < 0)? 0 : qMax(streams, 1);
+}
+
 void UploadJob::start()
 {
     m_port = MIN_PORT;
@@ -46,88 +108,277 @@ void UploadJob::start()
         if (m_port > MAX_PORT) { //No ports available?
             qCWarning(KDECONNECT_CORE) << "Error opening a port in range" << MIN_PORT << "-" << MAX_PORT;
             m_port = 0;
-            setError(1);
-            setErrorText(i18n("Couldn't find an available port"));
-            emitResult();
+            finish(1, i18n("Couldn't find an available port"));
             return;
         }
     }
+    m_state = Listening;
     connect(m_server, &QTcpServer::newConnection, this, &UploadJob::newConnection);
 }
 
 void UploadJob::newConnection()
 {
-    if (!m_input->open(QIODevice::ReadOnly)) {
-        qCWarning(KDECONNECT_CORE) << "error when opening the input to upload";
-        return; //TODO: Handle error, clean up...
+    if (m_state != Listening && m_state != Handshaking && m_state != Sending) {
+        return;
     }
 
-    Server* server = qobject_cast<Server*>(sender());
-    // FIXME : It is called again when payload sending is finished. Unsolved mystery :(
-    disconnect(m_server, &QTcpServer::newConnection, this, &UploadJob::newConnection);
+    if (m_streams.isEmpty()) {
+        if (!m_input->open(QIODevice::ReadOnly)) {
+            qCWarning(KDECONNECT_CORE) << "error when opening the input to upload";
+            return; //TODO: Handle error, clean up...
+        }
 
-    m_socket = server->nextPendingConnection();
-    m_socket->setParent(this);
-    connect(m_socket, &QSslSocket::disconnected, this, &UploadJob::cleanup);
-    connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketFailed(QAbstractSocket::SocketError)));
-    connect(m_socket, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrors(QList<QSslError>)));
-    connect(m_socket, &QSslSocket::encrypted, this, &UploadJob::startUploading);
+        //Not mapped, even for local files: if the file is truncated while we send it, reading just
+        //comes short instead of crashing the daemon with SIGBUS
+        m_buffer.resize(CHUNK_SIZE);
+        if (!m_input->isSequential()) {
+            setTotalAmount(Bytes, m_input->size());
+        }
+        m_state = Handshaking;
+    }
+
+    const int expectedStreams = qMax(m_streamCount, 1);
+    while (m_server->hasPendingConnections() && m_streams.size() < expectedStreams) {
+        QSslSocket* socket = m_server->nextPendingConnection();
+        socket->setParent(this);
+        connect(socket, &QSslSocket::disconnected, this, &UploadJob::cleanup);
+        connect(socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketFailed(QAbstractSocket::SocketError)));
+        connect(socket, SIGNAL(sslErrors(QList<QSslError>)), this, SLOT(sslErrors(QList<QSslError>)));
+        connect(socket, &QSslSocket::encrypted, this, &UploadJob::startUploading);
+        connect(socket, &QIODevice::bytesWritten, this, &UploadJob::bytesWritten);
+        if (m_streamCount > 0) {
+            connect(socket, &QIODevice::readyRead, this, &UploadJob::rangeRequested);
+        }
 //     connect(mSocket, &QAbstractSocket::stateChanged, [](QAbstractSocket::SocketState state){ qDebug() << "statechange" << state; });
 
-    LanLinkProvider::configureSslSocket(m_socket, m_deviceId, true);
+        //Without range requests the whole input goes through this connection, until it has no more
+        m_streams.append({socket, 0, -1, false});
 
-    m_socket->startServerEncryption();
+        LanLinkProvider::configureSslSocket(socket, m_deviceId, true);
+
+        socket->startServerEncryption();
+    }
+
+    if (m_streams.size() == expectedStreams) {
+        // FIXME : It is called again when payload sending is finished. Unsolved mystery :(
+        disconnect(m_server, &QTcpServer::newConnection, this, &UploadJob::newConnection);
+    }
+}
+
+UploadJob::Stream* UploadJob::streamFor(QObject* socket)
+{
+    for (Stream& stream : m_streams) {
+        if (stream.socket == socket) {
+            return &stream;
+        }
+    }
+    return nullptr;
 }
 
 void UploadJob::startUploading()
 {
-    while ( m_input->bytesAvailable() > 0 )
-    {
-        qint64 bytes = qMin(m_input->bytesAvailable(), (qint64)4096);
-        int w = m_socket->write(m_input->read(bytes));
-        if (w<0) {
-            qCWarning(KDECONNECT_CORE) << "error when writing data to upload" << bytes << m_input->bytesAvailable();
+    if (m_state == Handshaking && qobject_cast<QSslSocket*>(sender())) {
+        m_state = Sending;
+        m_timer.start();
+    }
+    if (m_state != Sending) {
+        return;
+    }
+
+    for (Stream& stream : m_streams) {
+        writeStream(&stream);
+    }
+}
+
+void UploadJob::rangeRequested()
+{
+    Stream* stream = streamFor(sender());
+    if (!stream || stream->end >= 0 || stream->done || !stream->socket->canReadLine()) {
+        return;
+    }
+
+    const QJsonObject request = QJsonDocument::fromJson(stream->socket->readLine()).object();
+    const qint64 size = m_input->size();
+    const QJsonValue lengthValue = request.value(QStringLiteral("length"));
+    qint64 offset = 0;
+    qint64 length = 0;
+    bool valid = readRangeBound(request.value(QStringLiteral("offset")), size, &offset);
+    if (valid && lengthValue.isDouble() && lengthValue.toDouble() == -1) {
+        length = size - offset;
+    } else {
+        valid = valid && readRangeBound(lengthValue, size, &length) && length <= size - offset;
+    }
+    if (!valid) {
+        qCWarning(KDECONNECT_CORE) << "Invalid range requested" << request << "of" << size;
+        stream->done = true;
+        stream->socket->abort();
+        finish(3, i18n("Invalid range requested"));
+        return;
+    }
+
+    stream->pos = offset;
+    stream->end = offset + length;
+    writeStream(stream);
+}
+
+void UploadJob::writeStream(Stream* stream)
+{
+    QSslSocket* socket = stream->socket;
+    if (m_state != Sending || stream->done || !socket->isEncrypted()) {
+        return;
+    }
+    if (m_streamCount > 0 && stream->end < 0) {
+        return; //Waiting for the downloader to tell which range it wants
+    }
+
+    //Only top up what the socket has pending, we'll be back from bytesWritten when it sends some of it.
+    //Never wait for the socket here, the rest of the daemon runs in this same thread.
+    while (socket->bytesToWrite() < HIGH_WATER_MARK) {
+        qint64 bytes;
+        if (stream->end >= 0) {
+            bytes = qMin(stream->end - stream->pos, CHUNK_SIZE);
+            if (bytes > 0) {
+                bytes = m_input->seek(stream->pos)? m_input->read(m_buffer.data(), bytes) : -1;
+                if (bytes <= 0) {
+                    //Eg: the file was truncated while we were sending it, the downloader can't get its range
+                    qCWarning(KDECONNECT_CORE) << "Couldn't read the input to upload," << stream->end - stream->pos << "bytes missing";
+                    stream->done = true;
+                    socket->abort();
+                    finish(4, i18n("The file changed while it was being sent"));
+                    return;
+                }
+                bytes = socket->write(m_buffer.constData(), bytes);
+                stream->pos += qMax<qint64>(bytes, 0);
+            }
+        } else {
+            bytes = m_input->read(m_buffer.data(), m_buffer.size());
+            if (bytes > 0) {
+                bytes = socket->write(m_buffer.constData(), bytes);
+            }
+        }
+
+        if (bytes < 0) {
+            qCWarning(KDECONNECT_CORE) << "error when writing data to upload" << m_input->bytesAvailable();
             break;
         }
-        else
-        {
-            while ( m_socket->flush() );
+        if (bytes == 0) {
+            break;
         }
     }
-    m_input->close();
+
+    const bool drained = stream->end >= 0? stream->pos == stream->end : m_input->bytesAvailable() <= 0;
+    if (!drained) {
+        return;
+    }
+    stream->done = true;
+
+    bool allDone = m_streams.size() == qMax(m_streamCount, 1);
+    for (const Stream& other : qAsConst(m_streams)) {
+        allDone = allDone && other.done;
+    }
+    if (allDone) {
+        m_state = Closing;
+        m_input->close(); //Disconnects every stream in aboutToClose
+    } else {
+        //Sends what is still pending before disconnecting
+        socket->disconnectFromHost();
+    }
+}
+
+void UploadJob::bytesWritten(qint64 bytes)
+{
+    m_written += bytes;
+    setProcessedAmount(Bytes, m_written);
+    const qint64 elapsed = m_timer.elapsed();
+    if (elapsed > 0) {
+        emitSpeed((1000 * m_written) / elapsed);
+    }
+
+    if (Stream* stream = streamFor(sender())) {
+        writeStream(stream);
+    }
 }
 
 void UploadJob::aboutToClose()
 {
 //     qDebug() << "closing...";
-    m_socket->disconnectFromHost();
+    //Sends what is still pending before disconnecting
+    for (const Stream& stream : qAsConst(m_streams)) {
+        stream.socket->disconnectFromHost();
+    }
 }
 
 void UploadJob::cleanup()
 {
-    m_socket->close();
+    Stream* stream = streamFor(sender());
+    if (!stream) {
+        return;
+    }
+    stream->socket->close();
 //     qDebug() << "closed!";
+    if (!stream->done) {
+        finish(2, i18n("Connection closed before the upload was done"));
+        return;
+    }
+    for (const Stream& other : qAsConst(m_streams)) {
+        if (other.socket->state() != QAbstractSocket::UnconnectedState) {
+            return;
+        }
+    }
+    if (m_state == Closing) {
+        finish(0);
+    }
+}
+
+void UploadJob::finish(int error, const QString& errorText)
+{
+    if (m_state == Finished) {
+        return;
+    }
+    m_state = Finished;
+    if (error) {
+        setError(error);
+        setErrorText(errorText);
+    }
     emitResult();
 }
 
 QVariantMap UploadJob::transferInfo()
 {
     Q_ASSERT(m_port != 0);
-    return {{"port", m_port}};
+    QVariantMap info = {{"port", m_port}};
+    if (m_streamCount > 0) {
+        info.insert(QStringLiteral("streams"), m_streamCount);
+        //Lets the receiver tell if what it has from an interrupted transfer is from this same file
+        if (QFile* file = qobject_cast<QFile*>(m_input.data())) {
+            const QString contentId = contentIdFor(file->fileName());
+            if (!contentId.isEmpty()) {
+                info.insert(QStringLiteral("contentId"), contentId);
+            }
+        }
+    }
+    return info;
 }
 
 void UploadJob::socketFailed(QAbstractSocket::SocketError error)
 {
+    //The peer closing the connection after reading everything isn't an error
+    Stream* stream = streamFor(sender());
+    if (error == QAbstractSocket::RemoteHostClosedError && stream && stream->done) {
+        return;
+    }
     qWarning() << "error uploading" << error;
-    setError(2);
-    emitResult();
-    m_socket->close();
+    finish(2, stream? stream->socket->errorString() : QString());
+    if (stream) {
+        stream->socket->close();
+    }
 }
 
 void UploadJob::sslErrors(const QList<QSslError>& errors)
 {
     qWarning() << "ssl errors" << errors;
-    setError(1);
-    emitResult();
-    m_socket->close();
+    finish(1, i18n("Couldn't establish a secure connection"));
+    if (Stream* stream = streamFor(sender())) {
+        stream->socket->close();
+    }
 }
@@ -23,10 +23,12 @@
 
 #include <KJob>
 
+#include <QElapsedTimer>
 #include <QIODevice>
 #include <QVariantMap>
 #include <QSharedPointer>
 #include <QSslSocket>
+#include <QVector>
 #include "server.h"
 
 class KDECONNECTCORE_EXPORT UploadJob
@@ -37,21 +39,55 @@ public:
     explicit UploadJob(const QSharedPointer<QIODevice>& source, const QString& deviceId);
 
     void start() override;
+    //Accept this many connections, each one sending the range of the payload its downloader asks for.
+    //Only for peers that announce the "ranges" payload transport, older ones expect everything on one
+    //connection without asking. Ignored for sequential inputs, which can't be read out of order, and
+    //when the payload size the packet announces is unknown (-1), since the receiver can't split it.
+    void setStreamCount(int streams, qint64 payloadSize);
 
     QVariantMap transferInfo();
 
+    enum State {
+        Idle,        //Not started yet
+        Listening,   //Waiting for the peer to connect
+        Handshaking, //Waiting for the connection to be encrypted
+        Sending,     //Writing the input while the socket has room for it
+        Closing,     //Everything is written, waiting for the socket to send it and disconnect
+        Finished
+    };
+    State state() const { return m_state; }
+
 private:
+    struct Stream {
+        QSslSocket* socket;
+        qint64 pos;
+        qint64 end; //-1 while waiting for the range, and for sequential inputs
+        bool done;
+    };
+
+    Stream* streamFor(QObject* socket);
+    void writeStream(Stream* stream);
+    void finish(int error, const QString& errorText = QString());
+
     const QSharedPointer<QIODevice> m_input;
     Server * const m_server;
-    QSslSocket* m_socket;
+    QVector<Stream> m_streams;
+    int m_streamCount; //0 for a single connection that gets the whole payload without asking
     quint16 m_port;
     const QString m_deviceId;
+    QByteArray m_buffer; //What we read from m_input on its way to the sockets
+
+    State m_state;
+    qint64 m_written;
+    QElapsedTimer m_timer;
 
     const static quint16 MIN_PORT = 1739;
     const static quint16 MAX_PORT = 1764;
 
 private Q_SLOTS:
     void startUploading();
+    void rangeRequested();
+    void bytesWritten(qint64 bytes);
     void newConnection();
     void aboutToClose();
     void cleanup();
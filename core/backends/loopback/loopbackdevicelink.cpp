@@ -35,17 +35,20 @@ QString LoopbackDeviceLink::name()
 
 bool LoopbackDeviceLink::sendPacket(NetworkPacket& input)
 {
-    NetworkPacket output(QString::null);
-    NetworkPacket::unserialize(input.serialize(), &output);
+    //No need to go through serialize(), the copy shares the body with the input
+    NetworkPacket output(input);
+    return sendPacket(std::move(output));
+}
 
+bool LoopbackDeviceLink::sendPacket(NetworkPacket&& input)
+{
     //LoopbackDeviceLink does not need deviceTransferInfo
     if (input.hasPayload()) {
         bool b = input.payload()->open(QIODevice::ReadOnly);
         Q_ASSERT(b);
-        output.setPayload(input.payload(), input.payloadSize());
     }
 
-    Q_EMIT receivedPacket(output);
+    Q_EMIT receivedPacket(input);
 
     return true;
 }
@@ -21,11 +21,12 @@
 #ifndef LOOPBACKDEVICELINK_H
 #define LOOPBACKDEVICELINK_H
 
+#include <kdeconnectcore_export.h>
 #include "../devicelink.h"
 
 class LoopbackLinkProvider;
 
-class LoopbackDeviceLink
+class KDECONNECTCORE_EXPORT LoopbackDeviceLink
     : public DeviceLink
 {
     Q_OBJECT
@@ -34,6 +35,7 @@ public:
 
     QString name() override;
     bool sendPacket(NetworkPacket& np) override;
+    bool sendPacket(NetworkPacket&& np) override;
 
     void userRequestsPair() override { setPairStatus(Paired); }
     void userRequestsUnpair() override { setPairStatus(NotPaired); }
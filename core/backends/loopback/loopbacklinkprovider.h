@@ -25,7 +25,9 @@
 #include "loopbackdevicelink.h"
 #include <QPointer>
 
-class LoopbackLinkProvider
+#include <kdeconnectcore_export.h>
+
+class KDECONNECTCORE_EXPORT LoopbackLinkProvider
     : public LinkProvider
 {
     Q_OBJECT
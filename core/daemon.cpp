@@ -227,6 +227,7 @@ void Daemon::setAnnouncedName(const QString& name)
 {
     qCDebug(KDECONNECT_CORE()) << "Announcing name";
     KdeConnectConfig::instance()->setName(name);
+    NetworkPacket::invalidateIdentityPacket();
     forceOnNetworkChange();
     Q_EMIT announcedNameChanged(name);
 }
@@ -94,6 +94,7 @@ void Device::reloadPlugins()
 {
     QHash<QString, KdeConnectPlugin*> newPluginMap, oldPluginMap = m_plugins;
     QMultiMap<QString, KdeConnectPlugin*> newPluginsByIncomingCapability;
+    QVector<QVector<KdeConnectPlugin*>> newPluginsByIncomingTypeId;
 
     if (isTrusted() && isReachable()) { //Do not load any plugin for unpaired devices, nor useless loading them for unreachable devices
 
@@ -115,6 +116,12 @@ void Device::reloadPlugins()
 
                 for (const QString& interface : incomingCapabilities) {
                     newPluginsByIncomingCapability.insert(interface, plugin);
+
+                    const int typeId = NetworkPacket::registerType(interface);
+                    if (typeId >= newPluginsByIncomingTypeId.size()) {
+                        newPluginsByIncomingTypeId.resize(typeId + 1);
+                    }
+                    newPluginsByIncomingTypeId[typeId].append(plugin);
                 }
 
                 newPluginMap[pluginName] = plugin;
@@ -129,6 +136,7 @@ void Device::reloadPlugins()
     qDeleteAll(m_plugins);
     m_plugins = newPluginMap;
     m_pluginsByIncomingCapability = newPluginsByIncomingCapability;
+    m_pluginsByIncomingTypeId = newPluginsByIncomingTypeId;
 
     QDBusConnection bus = QDBusConnection::sessionBus();
     for (KdeConnectPlugin* plugin : qAsConst(m_plugins)) {
@@ -329,10 +337,40 @@ bool Device::sendPacket(NetworkPacket& np)
     return false;
 }
 
+bool Device::sendPacket(NetworkPacket&& np)
+{
+    Q_ASSERT(np.type() != PACKET_TYPE_PAIR);
+    Q_ASSERT(isTrusted());
+
+    if (m_deviceLinks.isEmpty()) {
+        return false;
+    }
+
+    //Only the last link we try can have the packet, the others may fail and need it intact
+    const int last = m_deviceLinks.size() - 1;
+    for (int i = 0; i < last; ++i) {
+        if (m_deviceLinks.at(i)->sendPacket(np)) return true;
+    }
+    return m_deviceLinks.at(last)->sendPacket(std::move(np));
+}
+
 void Device::privateReceivedPacket(const NetworkPacket& np)
 {
     Q_ASSERT(np.type() != PACKET_TYPE_PAIR);
     if (isTrusted()) {
+        const int typeId = np.typeId();
+        if (typeId >= 0 && typeId < m_pluginsByIncomingTypeId.size()) {
+            //Copy (cheap, implicitly shared) in case a plugin makes us reload the plugin list
+            const QVector<KdeConnectPlugin*> plugins = m_pluginsByIncomingTypeId.at(typeId);
+            if (!plugins.isEmpty()) {
+                for (KdeConnectPlugin* plugin : plugins) {
+                    plugin->receivePacket(np);
+                }
+                return;
+            }
+        }
+
+        //Types that were never interned take the string lookup
         const QList<KdeConnectPlugin*> plugins = m_pluginsByIncomingCapability.values(np.type());
         if (plugins.isEmpty()) {
             qWarning() << "discarding unsupported packet" << np.type() << "for" << name();
@@ -110,6 +110,8 @@ public Q_SLOTS:
     ///sends a @p np packet to the device
     ///virtual for testing purposes.
     virtual bool sendPacket(NetworkPacket& np);
+    //Like above, but the link that ends up sending the packet may take it over instead of copying it
+    virtual bool sendPacket(NetworkPacket&& np);
 
     //Dbus operations
 public Q_SLOTS:
@@ -155,6 +157,7 @@ private: //Fields (TODO: dPointer!)
 
     //Capabilities stuff
     QMultiMap<QString, KdeConnectPlugin*> m_pluginsByIncomingCapability;
+    QVector<QVector<KdeConnectPlugin*>> m_pluginsByIncomingTypeId; //Indexed by NetworkPacket::typeId()
     QSet<QString> m_supportedPlugins;
     QSet<PairingHandler*> m_pairRequests;
 };
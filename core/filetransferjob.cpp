@@ -21,14 +21,21 @@
 
 #include "filetransferjob.h"
 #include "daemon.h"
+#include "rangedpayload.h"
 #include <core_debug.h>
 
 #include <qalgorithms.h>
 #include <QFileInfo>
 #include <QDebug>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 
 #include <KLocalizedString>
 
+//How much to receive between updates of the partial state, only what's in the state is resumed
+static const qint64 STATE_SAVE_INTERVAL = 16 * 1024 * 1024;
+
 FileTransferJob::FileTransferJob(const QSharedPointer<QIODevice>& origin, qint64 size, const QUrl& destination)
     : KJob()
     , m_origin(origin)
@@ -38,6 +45,8 @@ FileTransferJob::FileTransferJob(const QSharedPointer<QIODevice>& origin, qint64
     , m_speedBytes(0)
     , m_written(0)
     , m_size(size)
+    , m_savedWritten(0)
+    , m_resumed(false)
 {
     Q_ASSERT(m_origin);
     Q_ASSERT(m_origin->isReadable());
@@ -50,8 +59,101 @@ FileTransferJob::FileTransferJob(const QSharedPointer<QIODevice>& origin, qint64
     qCDebug(KDECONNECT_CORE) << "FileTransferJob Downloading payload to" << destination << "size:" << size;
 }
 
+QString FileTransferJob::partialFile() const
+{
+    return m_destination.toLocalFile() + QStringLiteral(".part");
+}
+
+QString FileTransferJob::partialStateFile() const
+{
+    return m_destination.toLocalFile() + QStringLiteral(".part.state");
+}
+
+void FileTransferJob::resumePartialTransfer(RangedPayload* payload)
+{
+    if (payload->contentId().isEmpty()) {
+        return;
+    }
+    QFile stateFile(partialStateFile());
+    if (!stateFile.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    const QJsonObject state = QJsonDocument::fromJson(stateFile.readAll()).object();
+    if (qint64(state.value(QStringLiteral("size")).toDouble()) != payload->payloadSize()
+        || state.value(QStringLiteral("contentId")).toString() != payload->contentId()
+        || QFileInfo(partialFile()).size() != payload->payloadSize()) {
+        qCDebug(KDECONNECT_CORE) << "Not resuming" << m_destination << "the partial file is from something else";
+        return;
+    }
+
+    QVector<QPair<qint64, qint64>> missing;
+    const QJsonArray missingArray = state.value(QStringLiteral("missing")).toArray();
+    for (const QJsonValue& value : missingArray) {
+        const QJsonArray range = value.toArray();
+        const qint64 offset = qint64(range.at(0).toDouble(-1));
+        const qint64 length = qint64(range.at(1).toDouble(-1));
+        if (offset < 0 || length < 0 || offset + length > payload->payloadSize()) {
+            return;
+        }
+        missing.append(qMakePair(offset, length));
+    }
+
+    //We have a connection per range, if there are more holes than connections the last ones are
+    //fetched together with what's between them
+    while (missing.size() > payload->rangeCount()) {
+        const QPair<qint64, qint64> last = missing.takeLast();
+        missing.last().second = last.first + last.second - missing.last().first;
+    }
+    while (missing.size() < payload->rangeCount()) {
+        missing.append(qMakePair(payload->payloadSize(), qint64(0)));
+    }
+
+    if (!payload->setRanges(missing)) {
+        return;
+    }
+    m_resumed = true;
+    m_written = payload->payloadSize();
+    for (const QPair<qint64, qint64>& range : qAsConst(missing)) {
+        m_written -= range.second;
+    }
+    qCDebug(KDECONNECT_CORE) << "Resuming transfer to" << m_destination << "with" << m_written << "bytes already received";
+}
+
+void FileTransferJob::savePartialState()
+{
+    RangedPayload* payload = static_cast<RangedPayload*>(m_origin.data());
+    if (payload->contentId().isEmpty() || !m_file.isOpen() || !m_file.flush()) {
+        return;
+    }
+
+    QJsonArray missing;
+    for (int i = 0; i < payload->rangeCount(); ++i) {
+        const qint64 remaining = payload->rangeLength(i) - m_rangeWritten.at(i);
+        if (remaining > 0) {
+            missing.append(QJsonArray{payload->rangeOffset(i) + m_rangeWritten.at(i), remaining});
+        }
+    }
+    const QJsonObject state{
+        {QStringLiteral("size"), payload->payloadSize()},
+        {QStringLiteral("contentId"), payload->contentId()},
+        {QStringLiteral("missing"), missing}
+    };
+
+    QFile stateFile(partialStateFile());
+    if (stateFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        stateFile.write(QJsonDocument(state).toJson(QJsonDocument::Compact));
+    }
+    m_savedWritten = m_written;
+}
+
 void FileTransferJob::start()
 {
+    //Has to happen before the payload asks the sender for its ranges, which needs a few round trips.
+    //If it's too late the payload refuses to change them, and the whole file is downloaded again.
+    RangedPayload* payload = qobject_cast<RangedPayload*>(m_origin.data());
+    if (payload && m_destination.isLocalFile() && !QFile::exists(m_destination.toLocalFile())) {
+        resumePartialTransfer(payload);
+    }
     QMetaObject::invokeMethod(this, "doStart", Qt::QueuedConnection);
     //qCDebug(KDECONNECT_CORE) << "FileTransferJob start";
 }
@@ -69,11 +171,108 @@ void FileTransferJob::doStart()
         return;
     }
 
+    if (qobject_cast<RangedPayload*>(m_origin.data()) && m_destination.isLocalFile()) {
+        startRangedTransfer();
+        return;
+    }
+
     if (m_origin->bytesAvailable())
         startTransfer();
     connect(m_origin.data(), &QIODevice::readyRead, this, &FileTransferJob::startTransfer);
 }
 
+void FileTransferJob::startRangedTransfer()
+{
+    RangedPayload* payload = static_cast<RangedPayload*>(m_origin.data());
+    description(this, i18n("Receiving file over KDE Connect"),
+                        { i18nc("File transfer origin", "From"), m_from },
+                        { i18nc("File transfer destination", "To"), m_destination.toLocalFile() });
+
+    //Received into a partial file, so an interrupted transfer can be resumed when the same file is sent again
+    m_file.setFileName(partialFile());
+    //Unbuffered, so everything counted as written is in the file when the state is saved
+    const QIODevice::OpenMode mode = QIODevice::Unbuffered | (m_resumed? QIODevice::ReadWrite : QIODevice::WriteOnly | QIODevice::Truncate);
+    if (!m_file.open(mode) || !m_file.resize(payload->payloadSize())) {
+        setError(3);
+        setErrorText(i18n("Couldn't write to %1: %2", m_destination.toLocalFile(), m_file.errorString()));
+        emitResult();
+        return;
+    }
+    m_size = payload->payloadSize();
+    setTotalAmount(Bytes, m_size);
+    setProcessedAmount(Bytes, m_written);
+    m_timer.start();
+
+    m_rangeWritten.fill(0, payload->rangeCount());
+    savePartialState();
+    for (int i = 0; i < payload->rangeCount(); ++i) {
+        QIODevice* device = payload->rangeDevice(i);
+        connect(device, &QIODevice::readyRead, this, [this, i]() { writeRange(i); });
+        connect(device, &QIODevice::readChannelFinished, this, [this, i]() { rangeFinished(i); });
+    }
+    for (int i = 0; i < payload->rangeCount(); ++i) {
+        writeRange(i);
+    }
+}
+
+void FileTransferJob::writeRange(int range)
+{
+    RangedPayload* payload = static_cast<RangedPayload*>(m_origin.data());
+    QIODevice* device = payload->rangeDevice(range);
+    const qint64 offset = payload->rangeOffset(range);
+    const qint64 length = payload->rangeLength(range);
+    if (!m_file.isOpen()) {
+        return;
+    }
+
+    while (m_rangeWritten[range] < length && device->bytesAvailable() > 0) {
+        const QByteArray data = device->read(qMin(device->bytesAvailable(), length - m_rangeWritten[range]));
+        if (!m_file.seek(offset + m_rangeWritten[range]) || m_file.write(data) != data.size()) {
+            setError(3);
+            setErrorText(i18n("Couldn't write to %1: %2", m_destination.toLocalFile(), m_file.errorString()));
+            //What made it to the file before this can still be resumed, eg: once there is space again
+            savePartialState();
+            m_file.close();
+            emitResult();
+            return;
+        }
+        m_rangeWritten[range] += data.size();
+        m_written += data.size();
+    }
+    if (m_written - m_savedWritten >= STATE_SAVE_INTERVAL) {
+        savePartialState();
+    }
+
+    setProcessedAmount(Bytes, m_written);
+    const auto elapsed = m_timer.elapsed();
+    if (elapsed > 0) {
+        emitSpeed((1000 * m_written) / elapsed);
+    }
+
+    if (m_written == m_size) {
+        m_file.close();
+        QFile::remove(partialStateFile());
+        if (!QFile::rename(partialFile(), m_destination.toLocalFile())) {
+            setError(3);
+            setErrorText(i18n("Couldn't write to %1", m_destination.toLocalFile()));
+        }
+        qCDebug(KDECONNECT_CORE) << "Finished transfer" << m_destination;
+        emitResult();
+    }
+}
+
+void FileTransferJob::rangeFinished(int range)
+{
+    writeRange(range);
+    if (m_file.isOpen() && m_rangeWritten[range] < static_cast<RangedPayload*>(m_origin.data())->rangeLength(range)) {
+        savePartialState();
+        m_file.close();
+        setError(4);
+        setErrorText(i18n("Received incomplete file"));
+        emitResult();
+    }
+}
+
 void FileTransferJob::startTransfer()
 {
     // Don't put each ready read
@@ -130,6 +329,10 @@ bool FileTransferJob::doKill()
     if (m_reply) {
         m_reply->close();
     }
+    if (m_file.isOpen()) {
+        savePartialState();
+        m_file.close();
+    }
     if (m_origin) {
         m_origin->close();
     }
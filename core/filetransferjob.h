@@ -25,18 +25,27 @@
 #include <KJob>
 
 #include <QElapsedTimer>
+#include <QFile>
 #include <QIODevice>
 #include <QSharedPointer>
 #include <QUrl>
 #include <QNetworkReply>
+#include <QVector>
 
 #include "kdeconnectcore_export.h"
 
+class RangedPayload;
+
 /**
  * @short It will stream a device into a url destination
  *
  * Given a QIODevice, the file transfer job will use the system's QNetworkAccessManager
  * for putting the stream into the requested location.
+ *
+ * A RangedPayload going to a local file is written range by range instead, at the
+ * position each of them belongs to, as their data arrives. It's received into a
+ * ".part" file with a ".part.state" file next to it that lists what is still missing,
+ * which is all that needs to be requested if the same content is sent again.
  */
 class KDECONNECTCORE_EXPORT FileTransferJob
     : public KJob
@@ -62,6 +71,13 @@ protected:
 
 private:
     void startTransfer();
+    void startRangedTransfer();
+    void resumePartialTransfer(RangedPayload* payload);
+    void savePartialState();
+    QString partialFile() const;
+    QString partialStateFile() const;
+    void writeRange(int range);
+    void rangeFinished(int range);
     void transferFailed(QNetworkReply::NetworkError error);
     void transferFinished();
 
@@ -73,6 +89,10 @@ private:
     qulonglong m_speedBytes;
     qint64 m_written;
     qint64 m_size;
+    QFile m_file;
+    QVector<qint64> m_rangeWritten;
+    qint64 m_savedWritten;
+    bool m_resumed;
 };
 
 #endif
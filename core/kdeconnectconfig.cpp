@@ -215,6 +215,7 @@ void KdeConnectConfig::addTrustedDevice(const QString& id, const QString& name,
     d->m_trustedDevices->setValue(QStringLiteral("type"), type);
     d->m_trustedDevices->endGroup();
     d->m_trustedDevices->sync();
+    Q_EMIT deviceTrustChanged(id);
 
     QDir().mkpath(deviceConfigDir(id).path());
 }
@@ -235,6 +236,7 @@ void KdeConnectConfig::removeTrustedDevice(const QString& deviceId)
 {
     d->m_trustedDevices->remove(deviceId);
     d->m_trustedDevices->sync();
+    Q_EMIT deviceTrustChanged(deviceId);
     //We do not remove the config files.
 }
 
@@ -245,6 +247,9 @@ void KdeConnectConfig::setDeviceProperty(const QString& deviceId, const QString&
     d->m_trustedDevices->setValue(key, value);
     d->m_trustedDevices->endGroup();
     d->m_trustedDevices->sync();
+    if (key == QLatin1String("certificate")) {
+        Q_EMIT deviceTrustChanged(deviceId);
+    }
 }
 
 QString KdeConnectConfig::getDeviceProperty(const QString& deviceId, const QString& key, const QString& defaultValue)
@@ -22,6 +22,7 @@
 #define KDECONNECTCONFIG_H
 
 #include <QDir>
+#include <QObject>
 
 #include "kdeconnectcore_export.h"
 
@@ -32,7 +33,10 @@ namespace QCA {
 }
 
 class KDECONNECTCORE_EXPORT KdeConnectConfig
+    : public QObject
 {
+    Q_OBJECT
+
 public:
     struct DeviceInfo {
         QString deviceName;
@@ -77,6 +81,10 @@ public:
     QDir deviceConfigDir(const QString& deviceId);
     QDir pluginConfigDir(const QString& deviceId, const QString& pluginName); //Used by KdeConnectPluginConfig
 
+Q_SIGNALS:
+    //The device was trusted or untrusted, or the certificate stored for it changed
+    void deviceTrustChanged(const QString& deviceId);
+
 private:
     KdeConnectConfig();
 
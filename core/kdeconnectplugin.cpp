@@ -76,6 +76,16 @@ bool KdeConnectPlugin::sendPacket(NetworkPacket& np) const
     return d->m_device->sendPacket(np);
 }
 
+bool KdeConnectPlugin::sendPacket(NetworkPacket&& np) const
+{
+    if(!d->m_outgoingCapabilties.contains(np.type())) {
+        qCWarning(KDECONNECT_CORE) << metaObject()->className() << "tried to send an unsupported packet type" << np.type() << ". Supported:" << d->m_outgoingCapabilties;
+        return false;
+    }
+
+    return d->m_device->sendPacket(std::move(np));
+}
+
 QString KdeConnectPlugin::dbusPath() const
 {
     return {};
@@ -44,6 +44,8 @@ public:
     Device const* device() const;
 
     bool sendPacket(NetworkPacket& np) const;
+    //Hands the packet over to the device, for packets built in place or not needed after sending them
+    bool sendPacket(NetworkPacket&& np) const;
 
     KdeConnectPluginConfig* config() const;
 
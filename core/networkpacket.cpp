@@ -21,12 +21,19 @@
 #include "networkpacket.h"
 #include "core_debug.h"
 
-#include <QMetaObject>
-#include <QMetaProperty>
+#include <QAtomicInteger>
 #include <QByteArray>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+#include <QCborMap>
+#include <QCborValue>
+#endif
 #include <QDataStream>
 #include <QDateTime>
+#include <QHash>
+#include <QJsonArray>
 #include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocale>
 #include <QDebug>
 
 #include "dbushelper.h"
@@ -46,123 +53,479 @@ QDebug operator<<(QDebug s, const NetworkPacket& pkg)
 
 const int NetworkPacket::s_protocolVersion = 7;
 
+static qint64 nextPacketId()
+{
+    //Seeded with the clock once, so ids still look like the timestamps used by older versions and don't
+    //repeat across restarts, and then just counted up so packets created in the same millisecond differ
+    static QAtomicInteger<qint64> lastId(QDateTime::currentMSecsSinceEpoch());
+    return lastId.fetchAndAddRelaxed(1) + 1;
+}
+
 NetworkPacket::NetworkPacket(const QString& type, const QVariantMap& body)
-    : m_id(QString::number(QDateTime::currentMSecsSinceEpoch()))
+    : m_id()
+    , m_idNumber(nextPacketId())
+    , m_idIsNumber(false)
     , m_type(type)
+    , m_typeId(UnresolvedTypeId)
     , m_body(body)
     , m_payload()
     , m_payloadSize(0)
 {
 }
 
+NetworkPacket::NetworkPacket(const QString& type, QVariantMap&& body)
+    : m_id()
+    , m_idNumber(nextPacketId())
+    , m_idIsNumber(false)
+    , m_type(type)
+    , m_typeId(UnresolvedTypeId)
+    , m_body(std::move(body))
+    , m_payload()
+    , m_payloadSize(0)
+{
+}
+
+static QVariantMap& identityBody()
+{
+    static QVariantMap body;
+    return body;
+}
+
 void NetworkPacket::createIdentityPacket(NetworkPacket* np)
 {
-    KdeConnectConfig* config = KdeConnectConfig::instance();
-    np->m_id = QString::number(QDateTime::currentMSecsSinceEpoch());
+    QVariantMap& body = identityBody();
+    if (body.isEmpty()) {
+        KdeConnectConfig* config = KdeConnectConfig::instance();
+        body.insert(QStringLiteral("deviceId"), config->deviceId());
+        body.insert(QStringLiteral("deviceName"), config->name());
+        body.insert(QStringLiteral("deviceType"), config->deviceType());
+        body.insert(QStringLiteral("protocolVersion"),  NetworkPacket::s_protocolVersion);
+        body.insert(QStringLiteral("incomingCapabilities"), PluginLoader::instance()->incomingCapabilities());
+        body.insert(QStringLiteral("outgoingCapabilities"), PluginLoader::instance()->outgoingCapabilities());
+        if (cborSupported()) {
+            body.insert(QStringLiteral("packetEncodings"), QStringList{QStringLiteral("cbor")});
+        }
+        body.insert(QStringLiteral("packetCompression"), QStringList{QStringLiteral("deflate")});
+        body.insert(QStringLiteral("payloadTransports"), QStringList{QStringLiteral("channel"), QStringLiteral("ranges")});
+        body.insert(QStringLiteral("tlsProfiles"), QStringList{QStringLiteral("modern")});
+    }
+
+    np->m_id = QString();
+    np->m_idNumber = nextPacketId();
+    np->m_idIsNumber = false;
     np->m_type = PACKET_TYPE_IDENTITY;
+    np->m_typeId = UnresolvedTypeId;
     np->m_payload = QSharedPointer<QIODevice>();
     np->m_payloadSize = 0;
-    np->set(QStringLiteral("deviceId"), config->deviceId());
-    np->set(QStringLiteral("deviceName"), config->name());
-    np->set(QStringLiteral("deviceType"), config->deviceType());
-    np->set(QStringLiteral("protocolVersion"),  NetworkPacket::s_protocolVersion);
-    np->set(QStringLiteral("incomingCapabilities"), PluginLoader::instance()->incomingCapabilities());
-    np->set(QStringLiteral("outgoingCapabilities"), PluginLoader::instance()->outgoingCapabilities());
+    np->m_body = body;
+    np->m_rawBody = QJsonObject();
 
     //qCDebug(KDECONNECT_CORE) << "createIdentityPacket" << np->serialize();
 }
 
-template<class T>
-QVariantMap qobject2qvariant(const T* object)
+void NetworkPacket::invalidateIdentityPacket()
 {
-    QVariantMap map;
-    auto metaObject = T::staticMetaObject;
-    for(int i = metaObject.propertyOffset(); i < metaObject.propertyCount(); ++i) {
-        QMetaProperty prop = metaObject.property(i);
-        map.insert(QString::fromLatin1(prop.name()), prop.readOnGadget(object));
+    identityBody().clear();
+}
+
+//Only written from the main thread while plugins are being loaded, so lookups don't need to lock
+static QHash<QString, int>& typeRegistry()
+{
+    static QHash<QString, int> registry;
+    return registry;
+}
+
+int NetworkPacket::registerType(const QString& type)
+{
+    QHash<QString, int>& registry = typeRegistry();
+    QHash<QString, int>::const_iterator it = registry.constFind(type);
+    if (it != registry.constEnd()) {
+        return it.value();
     }
+    const int id = registry.size();
+    registry.insert(type, id);
+    return id;
+}
 
-    return map;
+int NetworkPacket::typeId() const
+{
+    if (m_typeId == UnresolvedTypeId) {
+        m_typeId = typeRegistry().value(m_type, UnknownTypeId);
+    }
+    return m_typeId;
 }
 
-QByteArray NetworkPacket::serialize() const
+//Appends @p string as a quoted JSON string, escaping it the same way QJsonDocument does
+static void appendJsonString(QByteArray& out, const QString& string)
 {
-    //Object -> QVariant
-    //QVariantMap variant;
-    //variant["id"] = mId;
-    //variant["type"] = mType;
-    //variant["body"] = mBody;
-    QVariantMap variant = qobject2qvariant(this);
+    static const char hexDigits[] = "0123456789abcdef";
+
+    const QByteArray utf8 = string.toUtf8();
+    const char* run = utf8.constData();
+    const char* const end = run + utf8.size();
 
-    if (hasPayload()) {
-        //qCDebug(KDECONNECT_CORE) << "Serializing payloadTransferInfo";
-        variant[QStringLiteral("payloadSize")] = payloadSize();
-        variant[QStringLiteral("payloadTransferInfo")] = m_payloadTransferInfo;
+    out.append('"');
+    for (const char* c = run; c != end; ++c) {
+        const uchar u = static_cast<uchar>(*c);
+        if (u >= 0x20 && u != '"' && u != '\\') {
+            continue;
+        }
+        out.append(run, int(c - run));
+        run = c + 1;
+        switch (u) {
+            case '"':  out.append("\\\"", 2); break;
+            case '\\': out.append("\\\\", 2); break;
+            case '\b': out.append("\\b", 2); break;
+            case '\f': out.append("\\f", 2); break;
+            case '\n': out.append("\\n", 2); break;
+            case '\r': out.append("\\r", 2); break;
+            case '\t': out.append("\\t", 2); break;
+            default: {
+                const char escaped[] = { '\\', 'u', '0', '0', hexDigits[u >> 4], hexDigits[u & 0xf] };
+                out.append(escaped, sizeof(escaped));
+            }
+        }
     }
+    out.append(run, int(end - run));
+    out.append('"');
+}
 
-    //QVariant -> json
-    auto jsonDocument = QJsonDocument::fromVariant(variant);
-    QByteArray json = jsonDocument.toJson(QJsonDocument::Compact);
-    if (json.isEmpty()) {
-        qCDebug(KDECONNECT_CORE) << "Serialization error:";
-    } else {
-        /*if (!isEncrypted()) {
-            //qCDebug(KDECONNECT_CORE) << "Serialized packet:" << json;
-        }*/
-        json.append('\n');
+static void appendJsonInteger(QByteArray& out, qint64 value)
+{
+    char digits[24];
+    char* const end = digits + sizeof(digits);
+    char* begin = end;
+    quint64 magnitude = (value < 0)? (0 - quint64(value)) : quint64(value);
+    do {
+        *--begin = char('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        *--begin = '-';
     }
+    out.append(begin, int(end - begin));
+}
 
-    return json;
+static void appendJsonValue(QByteArray& out, const QVariant& value);
+
+static void appendJsonObject(QByteArray& out, const QVariantMap& map)
+{
+    out.append('{');
+    for (QVariantMap::const_iterator it = map.constBegin(), itEnd = map.constEnd(); it != itEnd; ++it) {
+        if (it != map.constBegin()) {
+            out.append(',');
+        }
+        appendJsonString(out, it.key());
+        out.append(':');
+        appendJsonValue(out, it.value());
+    }
+    out.append('}');
 }
 
-template <class T>
-void qvariant2qobject(const QVariantMap& variant, T* object)
+static void appendJsonValue(QByteArray& out, const QVariant& value)
 {
-    for ( QVariantMap::const_iterator iter = variant.begin(); iter != variant.end(); ++iter )
-    {
-        const int propertyIndex = T::staticMetaObject.indexOfProperty(iter.key().toLatin1());
-        if (propertyIndex < 0) {
-            qCWarning(KDECONNECT_CORE) << "missing property" << object << iter.key();
-            continue;
+    switch (value.userType()) {
+        case QMetaType::UnknownType:
+            out.append("null", 4);
+            break;
+        case QMetaType::Bool:
+            if (value.toBool()) {
+                out.append("true", 4);
+            } else {
+                out.append("false", 5);
+            }
+            break;
+        case QMetaType::Int:
+        case QMetaType::UInt:
+        case QMetaType::Short:
+        case QMetaType::UShort:
+        case QMetaType::Long:
+        case QMetaType::LongLong:
+            appendJsonInteger(out, value.toLongLong());
+            break;
+        case QMetaType::Double:
+        case QMetaType::Float: {
+            const double d = value.toDouble();
+            if (qIsFinite(d)) {
+                out.append(QByteArray::number(d, 'g', QLocale::FloatingPointShortest));
+            } else {
+                out.append("null", 4);
+            }
+            break;
         }
+        case QMetaType::QString:
+            appendJsonString(out, value.toString());
+            break;
+        case QMetaType::QStringList: {
+            const QStringList list = value.toStringList();
+            out.append('[');
+            for (int i = 0; i < list.size(); ++i) {
+                if (i) out.append(',');
+                appendJsonString(out, list.at(i));
+            }
+            out.append(']');
+            break;
+        }
+        case QMetaType::QVariantList: {
+            const QVariantList list = value.toList();
+            out.append('[');
+            for (int i = 0; i < list.size(); ++i) {
+                if (i) out.append(',');
+                appendJsonValue(out, list.at(i));
+            }
+            out.append(']');
+            break;
+        }
+        case QMetaType::QVariantMap:
+            appendJsonObject(out, value.toMap());
+            break;
+        default: {
+            //Anything exotic goes through QJsonValue, wrapped in an array because a document can't hold a bare value
+            QJsonArray wrapper;
+            wrapper.append(QJsonValue::fromVariant(value));
+            const QByteArray json = QJsonDocument(wrapper).toJson(QJsonDocument::Compact);
+            out.append(json.constData() + 1, json.size() - 2);
+        }
+    }
+}
+
+QByteArray NetworkPacket::serialize() const
+{
+    QByteArray json;
+    serialize(json);
+    return json;
+}
+
+void NetworkPacket::serialize(QByteArray& out) const
+{
+    //Write the packet straight into the buffer, with the keys sorted like QJsonDocument would
+    out.append("{\"body\":", 8);
+    appendJsonObject(out, body());
+    out.append(",\"id\":", 6);
+    if (m_idIsNumber) {
+        appendJsonInteger(out, m_idNumber);
+    } else if (m_id.isNull()) {
+        out.append('"');
+        appendJsonInteger(out, m_idNumber);
+        out.append('"');
+    } else {
+        appendJsonString(out, m_id);
+    }
+    //Always there, like when they were written from the properties, a payloadSize of 0 means no payload
+    out.append(",\"payloadSize\":", 15);
+    appendJsonInteger(out, m_payloadSize);
+    out.append(",\"payloadTransferInfo\":", 23);
+    appendJsonObject(out, m_payloadTransferInfo);
+    out.append(",\"type\":", 8);
+    appendJsonString(out, m_type);
+    out.append("}\n", 2);
+}
 
-        QMetaProperty property = T::staticMetaObject.property(propertyIndex);
-        bool ret = property.writeOnGadget(object, *iter);
-        if (!ret) {
-            qCWarning(KDECONNECT_CORE) << "couldn't set" << object << "->" << property.name() << '=' << *iter;
+//True if @p s only has characters that are valid in a dbus path, so it doesn't need to be filtered
+static bool isDbusExportable(const QString& s)
+{
+    for (const QChar c : s) {
+        const ushort u = c.unicode();
+        if (!((u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') || (u >= '0' && u <= '9') || u == '_')) {
+            return false;
         }
     }
+    return true;
 }
 
 bool NetworkPacket::unserialize(const QByteArray& a, NetworkPacket* np)
 {
-    //Json -> QVariant
-    QJsonParseError parseError;
-    auto parser = QJsonDocument::fromJson(a, &parseError);
-    if (parser.isNull()) {
-        qCDebug(KDECONNECT_CORE) << "Unserialization error:" << parseError.errorString();
+    //A CBOR map starts with major type 5, a JSON object with '{' or whitespace
+    const bool isCbor = !a.isEmpty() && (static_cast<uchar>(a.at(0)) & 0xe0) == 0xa0;
+    if (!(isCbor? unserializeCbor(a, np) : unserializeJson(a, np))) {
         return false;
     }
 
-    auto variant = parser.toVariant().toMap();
-    qvariant2qobject(variant, np);
-
-    np->m_payloadSize = variant[QStringLiteral("payloadSize")].toInt(); //Will return 0 if was not present, which is ok
     if (np->m_payloadSize == -1) {
         np->m_payloadSize = np->get<int>(QStringLiteral("size"), -1);
     }
-    np->m_payloadTransferInfo = variant[QStringLiteral("payloadTransferInfo")].toMap(); //Will return an empty qvariantmap if was not present, which is ok
 
     //Ids containing characters that are not allowed as dbus paths would make app crash
-    if (np->m_body.contains(QStringLiteral("deviceId")))
-    {
-        QString deviceId = np->get<QString>(QStringLiteral("deviceId"));
-        DbusHelper::filterNonExportableCharacters(deviceId);
-        np->set(QStringLiteral("deviceId"), deviceId);
+    const QVariant* deviceId = np->field(QStringLiteral("deviceId"));
+    if (deviceId) {
+        QString id = deviceId->toString();
+        if (!isDbusExportable(id)) {
+            DbusHelper::filterNonExportableCharacters(id);
+            np->set(QStringLiteral("deviceId"), id);
+        }
+    }
+
+    return true;
+
+}
+
+bool NetworkPacket::unserializeJson(const QByteArray& a, NetworkPacket* np)
+{
+    //Json -> fields, reading every member of the parsed object once
+    QJsonParseError parseError;
+    const QJsonDocument parser = QJsonDocument::fromJson(a, &parseError);
+    if (!parser.isObject()) {
+        qCDebug(KDECONNECT_CORE) << "Unserialization error:" << parseError.errorString();
+        return false;
+    }
+
+    np->m_id = QLatin1String(""); //Stays empty if not present, not the id of whatever np held before
+    np->m_idNumber = 0;
+    np->m_idIsNumber = false;
+    np->m_payloadSize = 0; //Stays 0 if not present, which is ok
+    np->m_payloadTransferInfo.clear(); //Stays empty if not present, which is ok
+
+    const QJsonObject object = parser.object();
+    for (QJsonObject::const_iterator it = object.constBegin(), itEnd = object.constEnd(); it != itEnd; ++it) {
+        const QString& key = it.key();
+        const QJsonValue value = it.value();
+        if (key == QLatin1String("body")) {
+            //Fields are decoded lazily, see NetworkPacket::field
+            np->m_body.clear();
+            np->m_rawBody = value.toObject();
+        } else if (key == QLatin1String("type")) {
+            np->setType(value.toString());
+        } else if (key == QLatin1String("id")) {
+            //Some clients send the id as a number
+            np->m_idIsNumber = value.isDouble();
+            if (np->m_idIsNumber) {
+                np->m_id = QString();
+                np->m_idNumber = qint64(value.toDouble());
+            } else {
+                np->m_id = value.toString();
+            }
+        } else if (key == QLatin1String("payloadSize")) {
+            np->m_payloadSize = qint64(value.toDouble());
+        } else if (key == QLatin1String("payloadTransferInfo")) {
+            np->m_payloadTransferInfo = value.toObject().toVariantMap();
+        } else {
+            qCWarning(KDECONNECT_CORE) << "unknown packet field" << key;
+        }
     }
 
     return true;
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+
+bool NetworkPacket::cborSupported()
+{
+    return true;
+}
+
+QByteArray NetworkPacket::serializeCbor() const
+{
+    QCborMap map;
+    if (m_idIsNumber) {
+        map.insert(QStringLiteral("id"), m_idNumber);
+    } else {
+        map.insert(QStringLiteral("id"), id());
+    }
+    map.insert(QStringLiteral("type"), m_type);
+    map.insert(QStringLiteral("body"), QCborMap::fromVariantMap(body()));
+    //Always there, like in serialize()
+    map.insert(QStringLiteral("payloadSize"), m_payloadSize);
+    map.insert(QStringLiteral("payloadTransferInfo"), QCborMap::fromVariantMap(m_payloadTransferInfo));
+    return QCborValue(map).toCbor();
+}
+
+bool NetworkPacket::unserializeCbor(const QByteArray& a, NetworkPacket* np)
+{
+    QCborParserError parseError;
+    const QCborValue parser = QCborValue::fromCbor(a, &parseError);
+    if (parseError.error != QCborError::NoError || !parser.isMap()) {
+        qCDebug(KDECONNECT_CORE) << "Unserialization error:" << parseError.errorString();
+        return false;
+    }
+
+    np->m_id = QLatin1String("");
+    np->m_idNumber = 0;
+    np->m_idIsNumber = false;
+    np->m_payloadSize = 0;
+    np->m_payloadTransferInfo.clear();
 
+    const QCborMap map = parser.toMap();
+    for (QCborMap::ConstIterator it = map.constBegin(), itEnd = map.constEnd(); it != itEnd; ++it) {
+        const QString key = it.key().toString();
+        const QCborValue value = it.value();
+        if (key == QLatin1String("body")) {
+            np->m_rawBody = QJsonObject();
+            np->m_body = value.toMap().toVariantMap();
+        } else if (key == QLatin1String("type")) {
+            np->setType(value.toString());
+        } else if (key == QLatin1String("id")) {
+            np->m_idIsNumber = value.isInteger();
+            if (np->m_idIsNumber) {
+                np->m_id = QString();
+                np->m_idNumber = value.toInteger();
+            } else {
+                np->m_id = value.toString();
+            }
+        } else if (key == QLatin1String("payloadSize")) {
+            np->m_payloadSize = value.toInteger();
+        } else if (key == QLatin1String("payloadTransferInfo")) {
+            np->m_payloadTransferInfo = value.toMap().toVariantMap();
+        } else {
+            qCWarning(KDECONNECT_CORE) << "unknown packet field" << key;
+        }
+    }
+
+    return true;
+}
+
+#else
+
+bool NetworkPacket::cborSupported()
+{
+    return false;
+}
+
+QByteArray NetworkPacket::serializeCbor() const
+{
+    //Never negotiated without QCbor, see cborSupported()
+    return serialize();
+}
+
+bool NetworkPacket::unserializeCbor(const QByteArray& /*cbor*/, NetworkPacket* /*np*/)
+{
+    qCDebug(KDECONNECT_CORE) << "Unserialization error: received a CBOR packet but CBOR is not supported";
+    return false;
+}
+
+#endif
+
+const QVariant* NetworkPacket::field(const QString& key) const
+{
+    QVariantMap::const_iterator it = m_body.constFind(key);
+    if (it != m_body.constEnd()) {
+        return &it.value();
+    }
+
+    if (m_rawBody.isEmpty()) {
+        return nullptr;
+    }
+    QJsonObject::const_iterator raw = m_rawBody.constFind(key);
+    if (raw == m_rawBody.constEnd()) {
+        return nullptr;
+    }
+
+    //First read of this field: decode it and keep the result for the next get()
+    QVariantMap::iterator decoded = m_body.insert(key, raw.value().toVariant());
+    return &decoded.value();
+}
+
+void NetworkPacket::decodeBody() const
+{
+    if (m_rawBody.isEmpty()) {
+        return;
+    }
+
+    for (QJsonObject::const_iterator raw = m_rawBody.constBegin(), rawEnd = m_rawBody.constEnd(); raw != rawEnd; ++raw) {
+        if (!m_body.contains(raw.key())) {
+            m_body.insert(raw.key(), raw.value().toVariant());
+        }
+    }
+    m_rawBody = QJsonObject();
 }
 
 FileTransferJob* NetworkPacket::createPayloadTransferJob(const QUrl& destination) const
@@ -26,6 +26,8 @@
 #include <QObject>
 #include <QString>
 #include <QVariant>
+#include <QJsonObject>
+#include <QJsonValue>
 #include <QIODevice>
 //#include <QtCrypto>
 #include <QSharedPointer>
@@ -50,23 +52,58 @@ public:
     const static int s_protocolVersion;
 
     explicit NetworkPacket(const QString& type, const QVariantMap& body = {});
+    NetworkPacket(const QString& type, QVariantMap&& body);
 
+    //The identity body is built once and reused, call invalidateIdentityPacket() when our name or plugins change
     static void createIdentityPacket(NetworkPacket*);
+    static void invalidateIdentityPacket();
 
     QByteArray serialize() const;
+    //Appends the serialized packet to @p out, so callers can reuse the same buffer for every packet
+    void serialize(QByteArray& out) const;
     static bool unserialize(const QByteArray& json, NetworkPacket* out);
 
-    const QString& id() const { return m_id; }
+    //Binary alternative to serialize(), only used with peers that list "cbor" in the packetEncodings of their identity.
+    //unserialize() tells both encodings apart by their first byte.
+    static bool cborSupported();
+    QByteArray serializeCbor() const;
+
+    //Ids of packets created locally are strictly increasing within the process and only turned into a string when needed
+    const QString& id() const { if (m_id.isNull()) m_id = QString::number(m_idNumber); return m_id; }
     const QString& type() const { return m_type; }
-    QVariantMap& body() { return m_body; }
-    const QVariantMap& body() const { return m_body; }
+
+    //Packet types handled by plugins are interned when the plugins are loaded, so packets can be dispatched
+    //by a small integer instead of by string. typeId() is UnknownTypeId for types nobody registered.
+    enum { UnknownTypeId = -1 };
+    static int registerType(const QString& type);
+    int typeId() const;
+    QVariantMap& body() { decodeBody(); return m_body; }
+    const QVariantMap& body() const { decodeBody(); return m_body; }
 
     //Get and set info from body. Note that id and type can not be accessed through these.
     template<typename T> T get(const QString& key, const T& defaultValue = {}) const {
-        return m_body.value(key,defaultValue).template value<T>(); //Important note: Awesome template syntax is awesome
+        const QVariant* value = field(key);
+        return value? value->template value<T>() : defaultValue; //Important note: Awesome template syntax is awesome
     }
     template<typename T> void set(const QString& key, const T& value) { m_body[key] = QVariant(value); }
-    bool has(const QString& key) const { return m_body.contains(key); }
+    bool has(const QString& key) const { return m_body.contains(key) || m_rawBody.contains(key); }
+
+    //Calls visitor(key, value) for every field in the body, until it returns false. Fields received from the network
+    //are handed over as parsed JSON, without decoding them into QVariants first. Used by the generated packet structs.
+    //Returns false if the visitor stopped early.
+    template<typename Visitor> bool visitBody(Visitor visitor) const {
+        for (QVariantMap::const_iterator it = m_body.constBegin(), end = m_body.constEnd(); it != end; ++it) {
+            if (!visitor(it.key(), QJsonValue::fromVariant(it.value()))) {
+                return false;
+            }
+        }
+        for (QJsonObject::const_iterator it = m_rawBody.constBegin(), end = m_rawBody.constEnd(); it != end; ++it) {
+            if ((m_body.isEmpty() || !m_body.contains(it.key())) && !visitor(it.key(), it.value())) {
+                return false;
+            }
+        }
+        return true;
+    }
 
     QSharedPointer<QIODevice> payload() const { return m_payload; }
     void setPayload(const QSharedPointer<QIODevice>& device, qint64 payloadSize) { m_payload = device; m_payloadSize = payloadSize; Q_ASSERT(m_payloadSize >= -1); }
@@ -81,14 +118,29 @@ public:
 
 private:
 
-    void setId(const QString& id) { m_id = id; }
-    void setType(const QString& t) { m_type = t; }
-    void setBody(const QVariantMap& b) { m_body = b; }
+    void setId(const QString& id) { m_id = id; m_idIsNumber = false; }
+    void setType(const QString& t) { m_type = t; m_typeId = UnresolvedTypeId; }
+    void setBody(const QVariantMap& b) { m_body = b; m_rawBody = QJsonObject(); }
     void setPayloadSize(qint64 s) { m_payloadSize = s; }
 
-    QString m_id;
+    static bool unserializeJson(const QByteArray& json, NetworkPacket* np);
+    static bool unserializeCbor(const QByteArray& cbor, NetworkPacket* np);
+
+    const QVariant* field(const QString& key) const;
+    void decodeBody() const;
+
+    enum { UnresolvedTypeId = -2 };
+
+    mutable QString m_id; //Null until id() is called, if the id is only known as m_idNumber
+    qint64 m_idNumber;
+    bool m_idIsNumber; //The peer sent m_idNumber as a number and not as a string, it's written back the same way
     QString m_type;
-    QVariantMap m_body;
+    mutable int m_typeId;
+
+    //Received bodies are kept as parsed JSON and each field is decoded into m_body the first time it is read.
+    //Fields in m_body take precedence over the ones still in m_rawBody.
+    mutable QVariantMap m_body;
+    mutable QJsonObject m_rawBody;
 	
     QSharedPointer<QIODevice> m_payload;
     qint64 m_payloadSize;
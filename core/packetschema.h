@@ -0,0 +1,106 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKETSCHEMA_H
+#define PACKETSCHEMA_H
+
+#include <QJsonArray>
+#include <QJsonValue>
+#include <QString>
+#include <QStringList>
+
+#include <cmath>
+#include <limits>
+
+/*
+ * Field readers used by the packet structs that kdeconnect_generate_packets (see KDEConnectMacros.cmake)
+ * generates from .packets schema files. They read the parsed JSON value as the type the schema declares,
+ * without going through QVariant. Each of them returns false and leaves the field untouched if the value
+ * has another type. The only conversion is numbers for bools, which some clients send.
+ */
+namespace PacketSchema
+{
+
+inline bool read(const QJsonValue& value, bool* field)
+{
+    if (value.isBool()) {
+        *field = value.toBool();
+        return true;
+    }
+    if (!value.isDouble()) return false;
+    *field = value.toDouble() != 0;
+    return true;
+}
+
+//Whole numbers only, and only the ones that fit in T
+template<typename T>
+inline bool readInteger(const QJsonValue& value, T* field)
+{
+    if (!value.isDouble()) return false;
+    const double number = value.toDouble();
+    //-min() is a power of two, so unlike max() it's exact as a double
+    const double lowest = double(std::numeric_limits<T>::min());
+    if (!(number >= lowest && number < -lowest)) return false;
+    if (std::trunc(number) != number) return false;
+    *field = T(number);
+    return true;
+}
+
+inline bool read(const QJsonValue& value, int* field)
+{
+    return readInteger(value, field);
+}
+
+inline bool read(const QJsonValue& value, qint64* field)
+{
+    return readInteger(value, field);
+}
+
+inline bool read(const QJsonValue& value, double* field)
+{
+    if (!value.isDouble()) return false;
+    *field = value.toDouble();
+    return true;
+}
+
+inline bool read(const QJsonValue& value, QString* field)
+{
+    if (!value.isString()) return false;
+    *field = value.toString();
+    return true;
+}
+
+inline bool read(const QJsonValue& value, QStringList* field)
+{
+    if (!value.isArray()) return false;
+    const QJsonArray array = value.toArray();
+    QStringList list;
+    list.reserve(array.size());
+    for (const QJsonValue& item : array) {
+        if (!item.isString()) return false;
+        list.append(item.toString());
+    }
+    *field = list;
+    return true;
+}
+
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include "core_debug.h"
 #include "device.h"
 #include "kdeconnectplugin.h"
+#include "networkpacket.h"
 
 PluginLoader* PluginLoader::instance()
 {
@@ -36,10 +37,20 @@ PluginLoader* PluginLoader::instance()
 
 PluginLoader::PluginLoader()
 {
+    QSet<QString> incoming, outgoing;
     const QVector<KPluginMetaData> data = KPluginLoader::findPlugins(QStringLiteral("kdeconnect/"));
     for (const KPluginMetaData& metadata : data) {
         plugins[metadata.pluginId()] = metadata;
+
+        const QStringList incomingCapabilities = KPluginMetaData::readStringList(metadata.rawData(), QStringLiteral("X-KdeConnect-SupportedPacketType"));
+        for (const QString& type : incomingCapabilities) {
+            NetworkPacket::registerType(type);
+        }
+        incoming += incomingCapabilities.toSet();
+        outgoing += KPluginMetaData::readStringList(metadata.rawData(), QStringLiteral("X-KdeConnect-OutgoingPacketType")).toSet();
     }
+    m_incomingCapabilities = incoming.toList();
+    m_outgoingCapabilities = outgoing.toList();
 }
 
 QStringList PluginLoader::getPluginList() const
@@ -85,20 +96,12 @@ KdeConnectPlugin* PluginLoader::instantiatePluginForDevice(const QString& plugin
 
 QStringList PluginLoader::incomingCapabilities() const
 {
-    QSet<QString> ret;
-    for (const KPluginMetaData& service : qAsConst(plugins)) {
-        ret += KPluginMetaData::readStringList(service.rawData(), QStringLiteral("X-KdeConnect-SupportedPacketType")).toSet();
-    }
-    return ret.toList();
+    return m_incomingCapabilities;
 }
 
 QStringList PluginLoader::outgoingCapabilities() const
 {
-    QSet<QString> ret;
-    for (const KPluginMetaData& service : qAsConst(plugins)) {
-        ret += KPluginMetaData::readStringList(service.rawData(), QStringLiteral("X-KdeConnect-OutgoingPacketType")).toSet();
-    }
-    return ret.toList();
+    return m_outgoingCapabilities;
 }
 
 QSet<QString> PluginLoader::pluginsForCapabilities(const QSet<QString>& incoming, const QSet<QString>& outgoing)
@@ -48,6 +48,10 @@ private:
     PluginLoader();
     QHash<QString, KPluginMetaData> plugins;
 
+    //The plugin set doesn't change while we run, so the capabilities are collected once
+    QStringList m_incomingCapabilities;
+    QStringList m_outgoingCapabilities;
+
 
 };
 
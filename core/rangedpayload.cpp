@@ -0,0 +1,120 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rangedpayload.h"
+
+#include "core_debug.h"
+
+RangedPayload::RangedPayload(qint64 size, int rangeCount, QObject* parent)
+    : QIODevice(parent)
+    , m_currentRange(0)
+    , m_size(size)
+{
+    Q_ASSERT(size >= 0 && rangeCount > 0);
+    for (int i = 0; i < rangeCount; ++i) {
+        const qint64 offset = size * i / rangeCount;
+        const qint64 end = size * (i + 1) / rangeCount;
+        m_ranges.append({offset, end - offset, 0, false, false, QSharedPointer<QIODevice>()});
+    }
+
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void RangedPayload::setRangeDevice(int range, const QSharedPointer<QIODevice>& device)
+{
+    m_ranges[range].device = device;
+    connect(device.data(), &QIODevice::readyRead, this, &QIODevice::readyRead);
+    connect(device.data(), &QIODevice::readChannelFinished, this, [this, range]() {
+        m_ranges[range].finished = true;
+        rangeFinished();
+    });
+}
+
+bool RangedPayload::setRanges(const QVector<QPair<qint64, qint64>>& ranges)
+{
+    Q_ASSERT(ranges.size() == m_ranges.size());
+    for (const Range& range : qAsConst(m_ranges)) {
+        if (range.requested) {
+            //The sender is already sending what was asked for, we'd get it at the wrong offsets
+            qCWarning(KDECONNECT_CORE) << "Can't resume a payload whose ranges were already requested";
+            return false;
+        }
+    }
+    for (int i = 0; i < m_ranges.size(); ++i) {
+        m_ranges[i].offset = ranges.at(i).first;
+        m_ranges[i].length = ranges.at(i).second;
+        m_ranges[i].read = 0;
+    }
+    return true;
+}
+
+void RangedPayload::rangeFinished()
+{
+    for (const Range& range : qAsConst(m_ranges)) {
+        if (!range.finished) {
+            return;
+        }
+    }
+    Q_EMIT readChannelFinished();
+}
+
+qint64 RangedPayload::bytesAvailable() const
+{
+    if (m_currentRange >= m_ranges.size() || !m_ranges.at(m_currentRange).device) {
+        return QIODevice::bytesAvailable();
+    }
+    const Range& range = m_ranges.at(m_currentRange);
+    return qMin(range.device->bytesAvailable(), range.length - range.read) + QIODevice::bytesAvailable();
+}
+
+bool RangedPayload::atEnd() const
+{
+    return m_currentRange >= m_ranges.size() && QIODevice::bytesAvailable() == 0;
+}
+
+qint64 RangedPayload::readData(char* data, qint64 maxSize)
+{
+    qint64 total = 0;
+    while (total < maxSize && m_currentRange < m_ranges.size()) {
+        Range& range = m_ranges[m_currentRange];
+        if (!range.device) {
+            break;
+        }
+        const qint64 read = range.device->read(data + total, qMin(maxSize - total, range.length - range.read));
+        if (read < 0) {
+            return total > 0? total : -1;
+        }
+        if (read == 0 && range.read < range.length) {
+            if (range.finished) {
+                return total > 0? total : -1; //The range ended before all of its data arrived
+            }
+            break; //The rest of this range hasn't arrived yet
+        }
+        range.read += read;
+        total += read;
+        if (range.read == range.length) {
+            ++m_currentRange;
+        }
+    }
+    if (total == 0 && m_currentRange >= m_ranges.size()) {
+        return -1;
+    }
+    return total;
+}
@@ -0,0 +1,89 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RANGEDPAYLOAD_H
+#define RANGEDPAYLOAD_H
+
+#include <QIODevice>
+#include <QPair>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "kdeconnectcore_export.h"
+
+/*
+ * A payload split in consecutive byte ranges that arrive in parallel, each one through its own device.
+ *
+ * FileTransferJob writes every range at its position in the destination file as it arrives. Anyone else
+ * can read it as a plain sequential device, which returns the ranges one after the other.
+ */
+class KDECONNECTCORE_EXPORT RangedPayload
+    : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    //Splits size bytes in rangeCount ranges of about the same length, tiny payloads can get empty ranges
+    RangedPayload(qint64 size, int rangeCount, QObject* parent = nullptr);
+
+    qint64 payloadSize() const { return m_size; }
+    int rangeCount() const { return m_ranges.size(); }
+    qint64 rangeOffset(int range) const { return m_ranges.at(range).offset; }
+    qint64 rangeLength(int range) const { return m_ranges.at(range).length; }
+    QIODevice* rangeDevice(int range) const { return m_ranges.at(range).device.data(); }
+    //The device range's data comes from, only its first rangeLength(range) bytes are used
+    void setRangeDevice(int range, const QSharedPointer<QIODevice>& device);
+    //Replaces the (offset, length) of every range, to resume a transfer that only needs part of the payload.
+    //Refused, returning false, once any range has been requested from the sender.
+    bool setRanges(const QVector<QPair<qint64, qint64>>& ranges);
+    //To be called by the DeviceLink when it asks the sender for the range, which can't change after that
+    void setRangeRequested(int range) { m_ranges[range].requested = true; }
+
+    //Identifies the content being sent, empty if the sender doesn't know how to. Used to resume transfers.
+    QString contentId() const { return m_contentId; }
+    void setContentId(const QString& contentId) { m_contentId = contentId; }
+
+    bool isSequential() const override { return true; }
+    qint64 bytesAvailable() const override;
+    bool atEnd() const override;
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char*, qint64) override { return -1; }
+
+private:
+    void rangeFinished();
+
+    struct Range {
+        qint64 offset;
+        qint64 length;
+        qint64 read;
+        bool requested;
+        bool finished;
+        QSharedPointer<QIODevice> device;
+    };
+
+    QVector<Range> m_ranges;
+    int m_currentRange;
+    qint64 m_size;
+    QString m_contentId;
+};
+
+#endif
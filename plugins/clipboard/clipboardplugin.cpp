@@ -37,8 +37,7 @@ ClipboardPlugin::ClipboardPlugin(QObject* parent, const QVariantList& args)
 
 void ClipboardPlugin::propagateClipboard(const QString& content)
 {
-    NetworkPacket np(PACKET_TYPE_CLIPBOARD, {{"content", content}});
-    sendPacket(np);
+    sendPacket(NetworkPacket(PACKET_TYPE_CLIPBOARD, {{"content", content}}));
 }
 
 bool ClipboardPlugin::receivePacket(const NetworkPacket& np)
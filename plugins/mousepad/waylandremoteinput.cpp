@@ -19,6 +19,7 @@
  */
 
 #include "waylandremoteinput.h"
+#include "mousepad_packets.h"
 
 #include <QSizeF>
 #include <QDebug>
@@ -60,18 +61,24 @@ bool WaylandRemoteInput::handlePacket(const NetworkPacket& np)
         m_waylandAuthenticationRequested = true;
     }
 
-    const float dx = np.get<float>(QStringLiteral("dx"), 0);
-    const float dy = np.get<float>(QStringLiteral("dy"), 0);
+    MousepadRequest request;
+    if (!request.decode(np)) {
+        qWarning() << "Ignoring malformed mousepad request";
+        return false;
+    }
+
+    const float dx = request.dx;
+    const float dy = request.dy;
 
-    const bool isSingleClick = np.get<bool>(QStringLiteral("singleclick"), false);
-    const bool isDoubleClick = np.get<bool>(QStringLiteral("doubleclick"), false);
-    const bool isMiddleClick = np.get<bool>(QStringLiteral("middleclick"), false);
-    const bool isRightClick = np.get<bool>(QStringLiteral("rightclick"), false);
-    const bool isSingleHold = np.get<bool>(QStringLiteral("singlehold"), false);
-    const bool isSingleRelease = np.get<bool>(QStringLiteral("singlerelease"), false);
-    const bool isScroll = np.get<bool>(QStringLiteral("scroll"), false);
-    const QString key = np.get<QString>(QStringLiteral("key"), QLatin1String(""));
-    const int specialKey = np.get<int>(QStringLiteral("specialKey"), 0);
+    const bool isSingleClick = request.singleclick;
+    const bool isDoubleClick = request.doubleclick;
+    const bool isMiddleClick = request.middleclick;
+    const bool isRightClick = request.rightclick;
+    const bool isSingleHold = request.singlehold;
+    const bool isSingleRelease = request.singlerelease;
+    const bool isScroll = request.scroll;
+    const QString key = request.key;
+    const int specialKey = request.specialKey;
 
     if (isSingleClick || isDoubleClick || isMiddleClick || isRightClick || isSingleHold || isScroll || !key.isEmpty() || specialKey) {
 
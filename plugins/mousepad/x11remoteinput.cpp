@@ -20,6 +20,7 @@
  */
 
 #include "x11remoteinput.h"
+#include "mousepad_packets.h"
 
 #include <QX11Info>
 #include <QCursor>
@@ -108,18 +109,24 @@ bool isLeftHanded(Display * display)
 
 bool X11RemoteInput::handlePacket(const NetworkPacket& np)
 {
-    float dx = np.get<float>(QStringLiteral("dx"), 0);
-    float dy = np.get<float>(QStringLiteral("dy"), 0);
-
-    bool isSingleClick = np.get<bool>(QStringLiteral("singleclick"), false);
-    bool isDoubleClick = np.get<bool>(QStringLiteral("doubleclick"), false);
-    bool isMiddleClick = np.get<bool>(QStringLiteral("middleclick"), false);
-    bool isRightClick = np.get<bool>(QStringLiteral("rightclick"), false);
-    bool isSingleHold = np.get<bool>(QStringLiteral("singlehold"), false);
-    bool isSingleRelease = np.get<bool>(QStringLiteral("singlerelease"), false);
-    bool isScroll = np.get<bool>(QStringLiteral("scroll"), false);
-    QString key = np.get<QString>(QStringLiteral("key"), QLatin1String(""));
-    int specialKey = np.get<int>(QStringLiteral("specialKey"), 0);
+    MousepadRequest request;
+    if (!request.decode(np)) {
+        qWarning() << "Ignoring malformed mousepad request";
+        return false;
+    }
+
+    float dx = request.dx;
+    float dy = request.dy;
+
+    bool isSingleClick = request.singleclick;
+    bool isDoubleClick = request.doubleclick;
+    bool isMiddleClick = request.middleclick;
+    bool isRightClick = request.rightclick;
+    bool isSingleHold = request.singlehold;
+    bool isSingleRelease = request.singlerelease;
+    bool isScroll = request.scroll;
+    QString key = request.key;
+    int specialKey = request.specialKey;
 
     if (isSingleClick || isDoubleClick || isMiddleClick || isRightClick || isSingleHold || isScroll || !key.isEmpty() || specialKey) {
         Display* display = QX11Info::display();
@@ -161,9 +168,9 @@ bool X11RemoteInput::handlePacket(const NetworkPacket& np)
             }
         } else if (!key.isEmpty() || specialKey) {
 
-            bool ctrl = np.get<bool>(QStringLiteral("ctrl"), false);
-            bool alt = np.get<bool>(QStringLiteral("alt"), false);
-            bool shift = np.get<bool>(QStringLiteral("shift"), false);
+            bool ctrl = request.ctrl;
+            bool alt = request.alt;
+            bool shift = request.shift;
 
             if (ctrl) XTestFakeKeyEvent (display, XKeysymToKeycode(display, XK_Control_L), True, 0);
             if (alt) XTestFakeKeyEvent (display, XKeysymToKeycode(display, XK_Alt_L), True, 0);
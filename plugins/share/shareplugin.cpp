@@ -163,7 +163,7 @@ void SharePlugin::shareUrl(const QUrl& url)
     } else {
         packet.set<QString>(QStringLiteral("url"), url.toString());
     }
-    sendPacket(packet);
+    sendPacket(std::move(packet));
 }
 
 QString SharePlugin::dbusPath() const
@@ -22,11 +22,14 @@
 
 
 #include "../core/backends/lan/lanlinkprovider.h"
+#include "../core/backends/lan/lanlinkworker.h"
+#include "../core/backends/lan/payloadchannel.h"
 #include "../core/backends/lan/server.h"
 #include "../core/backends/lan/socketlinereader.h"
 #include "../core/kdeconnectconfig.h"
 
 #include <QAbstractSocket>
+#include <QBuffer>
 #include <QSslSocket>
 #include <QtTest>
 #include <QSslKey>
@@ -56,6 +59,15 @@ private Q_SLOTS:
     void unpairedDeviceTcpPacketReceived();
     void unpairedDeviceUdpPacketReceived();
 
+    void packetCompression();
+    void receiveBatching();
+    void sendCoalescing();
+    void payloadChannel();
+    void sslConfigurationCache();
+    void reconnectManyDevices();
+    void manySimultaneousAnnouncements();
+    void handshakeStorm();
+    void linkedDeviceAnnouncements();
 
 private:
     const int TEST_PORT = 8520;
@@ -77,6 +89,7 @@ private:
     void removeTrustedDevice();
     void setSocketAttributes(QSslSocket* socket);
     void testIdentityPacket(QByteArray& identityPacket);
+    static QByteArray identityPacket(const QString& deviceId, const QString& deviceName, quint16 tcpPort);
 
 };
 
@@ -90,6 +103,8 @@ void LanLinkProviderTest::initTestCase()
     m_certificate = generateCertificate(m_deviceId, m_privateKey);
 
     m_lanLinkProvider.onStart();
+    //Most tests connect the same device again right after the last one, its previous link may not be gone yet
+    m_lanLinkProvider.setReconnectDebounce(0);
 
     m_identityPacket = QStringLiteral("{\"id\":1439365924847,\"type\":\"kdeconnect.identity\",\"body\":{\"deviceId\":\"testdevice\",\"deviceName\":\"Test Device\",\"protocolVersion\":6,\"deviceType\":\"phone\",\"tcpPort\":") + QString::number(TEST_PORT) + QStringLiteral("}}");
 }
@@ -145,6 +160,9 @@ void LanLinkProviderTest::pairedDeviceTcpPacketReceived()
     QVERIFY2(socket.isEncrypted(), "Server socket not yet encrypted");
     QVERIFY2(!socket.peerCertificate().isNull(), "Peer certificate is null");
 
+    //Remembered so we can find it again without a broadcast
+    QTRY_COMPARE(kcc->getDeviceProperty(m_deviceId, QStringLiteral("lastKnownAddress")), QHostAddress(QHostAddress::LocalHost).toString());
+
     removeTrustedDevice();
     delete mUdpServer;
 }
@@ -299,6 +317,529 @@ void LanLinkProviderTest::unpairedDeviceUdpPacketReceived()
     delete m_udpSocket;
 }
 
+void LanLinkProviderTest::packetCompression()
+{
+    //Small packets are sent as they are
+    NetworkPacket small(QStringLiteral("kdeconnect.clipboard"), {{QStringLiteral("content"), QStringLiteral("hello")}});
+    QVERIFY(LanDeviceLink::compressPacket(small.serialize()).isNull());
+
+    //A big clipboard paste is deflated and comes back the same
+    QString text;
+    for (int i = 0; i < 20000; ++i) {
+        text += QStringLiteral("line %1 of a long clipboard paste\n").arg(i);
+    }
+    NetworkPacket big(QStringLiteral("kdeconnect.clipboard"), {{QStringLiteral("content"), text}});
+    const QByteArray serialized = big.serialize();
+    const QByteArray compressed = LanDeviceLink::compressPacket(serialized);
+    QVERIFY(!compressed.isNull());
+    QVERIFY(compressed.size() < serialized.size() / 4);
+    QCOMPARE(LanDeviceLink::uncompressPacket(compressed), serialized);
+
+    NetworkPacket received(QLatin1String(""));
+    QVERIFY(NetworkPacket::unserialize(LanDeviceLink::uncompressPacket(compressed), &received));
+    QCOMPARE(received.get<QString>(QStringLiteral("content")), text);
+
+    //Data that doesn't compress is left alone
+    QByteArray random(64 * 1024, Qt::Uninitialized);
+    for (int i = 0; i < random.size(); ++i) {
+        random[i] = char(qrand());
+    }
+    QVERIFY(LanDeviceLink::compressPacket(random).isNull());
+
+    //Garbage and oversized claims are rejected
+    QVERIFY(LanDeviceLink::uncompressPacket(QByteArray("\x00\x00\x10\x00garbage", 11)).isNull());
+    QVERIFY(LanDeviceLink::uncompressPacket(QByteArray("\xff\xff\xff\xff") + compressed.mid(4)).isNull());
+
+    QBENCHMARK {
+        LanDeviceLink::uncompressPacket(LanDeviceLink::compressPacket(serialized));
+    }
+}
+
+void LanLinkProviderTest::receiveBatching()
+{
+    m_server = new Server(this);
+    QVERIFY(m_server->listen(QHostAddress::LocalHost, TEST_PORT));
+
+    QSslSocket client;
+    client.connectToHost(QHostAddress::LocalHost, TEST_PORT);
+    QVERIFY(client.waitForConnected());
+    QVERIFY(m_server->hasPendingConnections() || m_server->waitForNewConnection(4000));
+    QSslSocket* serverSocket = m_server->nextPendingConnection();
+    QVERIFY2(serverSocket != 0, "Server socket is null");
+
+    LanDeviceLink* link = new LanDeviceLink(m_deviceId, &m_lanLinkProvider, serverSocket, LanDeviceLink::Remotely);
+    link->setReceiveBudget(16, 1000);
+    int received = 0;
+    connect(link, &DeviceLink::receivedPacket, this, [&received](const NetworkPacket& np) {
+        QCOMPARE(np.type(), QStringLiteral("kdeconnect.ping"));
+        ++received;
+    });
+
+    const int packetCount = 1000;
+    QByteArray burst;
+    for (int i = 0; i < packetCount; ++i) {
+        burst += NetworkPacket(QStringLiteral("kdeconnect.ping")).serialize();
+    }
+    client.write(burst);
+    client.flush();
+
+    QTRY_COMPARE_WITH_TIMEOUT(received, packetCount, 10000);
+
+    //Every packet shows up in exactly one batch, and none of the batches went over the budget
+    const QVector<quint64> histogram = link->batchSizeHistogram();
+    quint64 batches = 0;
+    for (int bucket = 0; bucket < histogram.size(); ++bucket) {
+        batches += histogram[bucket];
+        if (bucket > 4) {
+            QCOMPARE(histogram[bucket], quint64(0));
+        }
+    }
+    QVERIFY(batches >= quint64(packetCount / 16));
+    QVERIFY(batches < quint64(packetCount));
+
+    delete link;
+    delete m_server;
+}
+
+void LanLinkProviderTest::sendCoalescing()
+{
+    m_server = new Server(this);
+    QVERIFY(m_server->listen(QHostAddress::LocalHost, TEST_PORT));
+
+    QSslSocket client;
+    client.connectToHost(QHostAddress::LocalHost, TEST_PORT);
+    QVERIFY(client.waitForConnected());
+    QVERIFY(m_server->hasPendingConnections() || m_server->waitForNewConnection(4000));
+    QSslSocket* serverSocket = m_server->nextPendingConnection();
+    QVERIFY2(serverSocket != 0, "Server socket is null");
+
+    LanDeviceLink* link = new LanDeviceLink(m_deviceId, &m_lanLinkProvider, serverSocket, LanDeviceLink::Remotely);
+    SocketLineReader reader(&client);
+
+    //A burst of packets sent from the same event loop iteration is written at once
+    const int packetCount = 50;
+    qint64 expectedBytes = 0;
+    for (int i = 0; i < packetCount; ++i) {
+        NetworkPacket np(QStringLiteral("kdeconnect.mousepad.request"), {{QStringLiteral("dx"), i}});
+        expectedBytes += np.serialize().size();
+        QVERIFY(link->sendPacket(np));
+    }
+    QCOMPARE(link->sentRecords(), quint64(0));
+
+    int received = 0;
+    connect(&reader, &SocketLineReader::readyRead, this, [&]() {
+        while (reader.bytesAvailable() > 0) {
+            NetworkPacket np(QLatin1String(""));
+            QVERIFY(NetworkPacket::unserialize(reader.readLine(), &np));
+            QCOMPARE(np.get<int>(QStringLiteral("dx")), received);
+            ++received;
+        }
+    });
+    QTRY_COMPARE(received, packetCount);
+    QCOMPARE(link->sentRecords(), quint64(1));
+    QCOMPARE(link->sentBytes(), quint64(expectedBytes));
+
+    //flush() doesn't wait for the event loop
+    NetworkPacket urgent(QStringLiteral("kdeconnect.mousepad.request"), {{QStringLiteral("singleclick"), true}});
+    QVERIFY(link->sendPacket(urgent));
+    link->flush();
+    QCOMPARE(link->sentRecords(), quint64(2));
+    QTRY_COMPARE(received, packetCount + 1);
+
+    //From the moment the socket is gone until the link deletes itself, packets are refused
+    QPointer<LanDeviceLink> guard(link);
+    client.abort();
+    QTRY_VERIFY(!guard || !guard->sendPacket(urgent));
+    QTRY_VERIFY(!guard);
+
+    delete m_server;
+}
+
+void LanLinkProviderTest::payloadChannel()
+{
+    //Payloads only come through the link of a paired device
+    addTrustedDevice();
+
+    m_server = new Server(this);
+    QVERIFY(m_server->listen(QHostAddress::LocalHost, TEST_PORT));
+
+    QSslSocket* client = new QSslSocket();
+    client->connectToHost(QHostAddress::LocalHost, TEST_PORT);
+    QVERIFY(client->waitForConnected());
+    QVERIFY(m_server->hasPendingConnections() || m_server->waitForNewConnection(4000));
+    QSslSocket* serverSocket = m_server->nextPendingConnection();
+    QVERIFY2(serverSocket != 0, "Server socket is null");
+
+    //The links take ownership of the sockets
+    LanDeviceLink* sender = new LanDeviceLink(m_deviceId, &m_lanLinkProvider, client, LanDeviceLink::Locally);
+    LanDeviceLink* receiver = new LanDeviceLink(m_deviceId, &m_lanLinkProvider, serverSocket, LanDeviceLink::Remotely);
+    NetworkPacket identity(QLatin1String(""));
+    NetworkPacket::createIdentityPacket(&identity);
+    sender->setPeerIdentity(identity);
+    receiver->setPeerIdentity(identity);
+
+    QByteArray data(1024 * 1024 + 123, Qt::Uninitialized);
+    for (int i = 0; i < data.size(); ++i) {
+        data[i] = char(i * 7);
+    }
+    QSharedPointer<QIODevice> source(new QBuffer(&data));
+
+    QByteArray receivedData;
+    QSharedPointer<QIODevice> payload;
+    bool finished = false;
+    connect(receiver, &DeviceLink::receivedPacket, this, [&](const NetworkPacket& np) {
+        QCOMPARE(np.type(), QStringLiteral("kdeconnect.share.request"));
+        QVERIFY(np.payloadTransferInfo().contains(QStringLiteral("stream")));
+        QCOMPARE(np.payloadSize(), qint64(data.size()));
+        payload = np.payload();
+        connect(payload.data(), &QIODevice::readyRead, this, [&]() {
+            receivedData += payload->readAll();
+        });
+        connect(payload.data(), &QIODevice::readChannelFinished, this, [&]() {
+            receivedData += payload->readAll();
+            finished = true;
+        });
+    });
+
+    //No listening port or extra connection is involved
+    NetworkPacket np(QStringLiteral("kdeconnect.share.request"), {{QStringLiteral("filename"), QStringLiteral("test")}});
+    np.setPayload(source, data.size());
+    QVERIFY(sender->sendPacket(np));
+
+    QTRY_VERIFY_WITH_TIMEOUT(finished, 10000);
+    QCOMPARE(receivedData.size(), data.size());
+    QVERIFY(receivedData == data);
+    QVERIFY(m_server->hasPendingConnections() == false);
+
+    delete sender;
+    delete receiver;
+    delete m_server;
+    removeTrustedDevice();
+
+    //The receiver buffers streams in memory, so endless or big ones are refused and a stream can't
+    //grow past the size it announced
+    PayloadChannel channel;
+    QVERIFY(!channel.addIncoming(1, -1));
+    QVERIFY(!channel.addIncoming(1, PayloadChannel::MAX_STREAM_SIZE + 1));
+    const QSharedPointer<QIODevice> small = channel.addIncoming(1, 4);
+    QVERIFY(small);
+    channel.receiveChunk(QByteArray::fromHex("00000001") + QByteArray("toolong"));
+    QVERIFY(small->atEnd());
+
+    //The id of a live stream can't be reused
+    const QSharedPointer<QIODevice> first = channel.addIncoming(2, 4);
+    QVERIFY(first);
+    QVERIFY(!channel.addIncoming(2, 4));
+    QVERIFY(!first->atEnd());
+    channel.receiveChunk(QByteArray::fromHex("00000002"));
+    QVERIFY(first->atEnd());
+
+    //Nor can there be too many streams, or too many bytes, in flight at once
+    PayloadChannel limits;
+    QVector<QSharedPointer<QIODevice>> streams;
+    for (int i = 0; i < PayloadChannel::MAX_STREAMS; ++i) {
+        streams.append(limits.addIncoming(i, 4));
+        QVERIFY(streams.last());
+    }
+    QVERIFY(!limits.addIncoming(PayloadChannel::MAX_STREAMS, 4));
+    limits.receiveChunk(QByteArray::fromHex("00000000"));
+    QVERIFY(limits.addIncoming(PayloadChannel::MAX_STREAMS, 4));
+
+    PayloadChannel big;
+    QVERIFY(big.addIncoming(1, PayloadChannel::MAX_STREAM_SIZE));
+    QVERIFY(big.addIncoming(2, PayloadChannel::MAX_PENDING_SIZE - PayloadChannel::MAX_STREAM_SIZE));
+    QVERIFY(!big.addIncoming(3, 1));
+    QVERIFY(!big.canAddOutgoing(PayloadChannel::MAX_STREAM_SIZE + 1));
+}
+
+void LanLinkProviderTest::sslConfigurationCache()
+{
+    addTrustedDevice();
+
+    QSslSocket first, second;
+    LanLinkProvider::configureSslSocket(&first, m_deviceId, true);
+    LanLinkProvider::configureSslSocket(&second, m_deviceId, true);
+    QCOMPARE(first.peerVerifyMode(), QSslSocket::VerifyPeer);
+    QCOMPARE(first.peerVerifyName(), m_deviceId);
+    QCOMPARE(first.sslConfiguration().caCertificates(), QList<QSslCertificate>{m_certificate});
+    QVERIFY(!first.sslConfiguration().privateKey().isNull());
+    QCOMPARE(second.sslConfiguration().privateKey(), first.sslConfiguration().privateKey());
+    QCOMPARE(second.sslConfiguration().localCertificate(), KdeConnectConfig::instance()->certificate());
+
+    //A new certificate for the device isn't hidden by the cache
+    QString otherName = QStringLiteral("otherdevice");
+    QCA::PrivateKey otherKey = QCA::KeyGenerator().createRSA(2048);
+    const QSslCertificate otherCertificate = generateCertificate(otherName, otherKey);
+    KdeConnectConfig::instance()->setDeviceProperty(m_deviceId, QStringLiteral("certificate"), QString::fromLatin1(otherCertificate.toPem()));
+    QSslSocket third;
+    LanLinkProvider::configureSslSocket(&third, m_deviceId, true);
+    QCOMPARE(third.sslConfiguration().caCertificates(), QList<QSslCertificate>{otherCertificate});
+
+    QSslSocket untrusted;
+    LanLinkProvider::configureSslSocket(&untrusted, m_deviceId, false);
+    QCOMPARE(untrusted.peerVerifyMode(), QSslSocket::QueryPeer);
+
+    //Nor is the device being paired again after unpairing
+    removeTrustedDevice();
+    addTrustedDevice();
+    QSslSocket repaired;
+    LanLinkProvider::configureSslSocket(&repaired, m_deviceId, true);
+    QCOMPARE(repaired.sslConfiguration().caCertificates(), QList<QSslCertificate>{m_certificate});
+
+    removeTrustedDevice();
+}
+
+void LanLinkProviderTest::reconnectManyDevices()
+{
+    //Like after a resume: a bunch of devices connect at the same time, all of them want a TLS handshake
+    QUdpSocket udpServer;
+    QVERIFY(udpServer.bind(QHostAddress::LocalHost, LanLinkProvider::UDP_PORT, QUdpSocket::ShareAddress));
+    QSignalSpy spy(&udpServer, SIGNAL(readyRead()));
+    m_lanLinkProvider.onNetworkChange();
+    QVERIFY(!spy.isEmpty() || spy.wait());
+
+    QByteArray datagram;
+    datagram.resize(udpServer.pendingDatagramSize());
+    udpServer.readDatagram(datagram.data(), datagram.size());
+    const QJsonObject body = QJsonDocument::fromJson(datagram).object().value(QStringLiteral("body")).toObject();
+    const int tcpPort = body.value(QStringLiteral("tcpPort")).toInt();
+
+    const int deviceCount = 20;
+    QSet<QString> connectedDevices;
+    QMetaObject::Connection connection = connect(&m_lanLinkProvider, &LinkProvider::onConnectionReceived, this,
+            [&connectedDevices](const NetworkPacket& identityPacket, DeviceLink*) {
+        connectedDevices.insert(identityPacket.get<QString>(QStringLiteral("deviceId")));
+    });
+
+    QElapsedTimer timer;
+    timer.start();
+    QVector<QSslSocket*> devices;
+    for (int i = 0; i < deviceCount; ++i) {
+        const QByteArray identity = identityPacket(QStringLiteral("reconnecting%1").arg(i), QStringLiteral("Device %1").arg(i), TEST_PORT);
+        QSslSocket* socket = new QSslSocket(this);
+        setSocketAttributes(socket);
+        socket->setPeerVerifyMode(QSslSocket::QueryPeer);
+        //We are the TCP client but the TLS server, as a phone answering our broadcast
+        connect(socket, &QAbstractSocket::connected, socket, [socket, identity]() {
+            socket->write(identity);
+            socket->startServerEncryption();
+        });
+        socket->connectToHost(QHostAddress::LocalHost, tcpPort);
+        devices.append(socket);
+    }
+
+    QTRY_COMPARE_WITH_TIMEOUT(connectedDevices.size(), deviceCount, 30000);
+    for (QSslSocket* socket : qAsConst(devices)) {
+        QTRY_VERIFY(socket->isEncrypted());
+    }
+    qDebug() << deviceCount << "devices reconnected in" << timer.elapsed() << "ms using" << LanLinkWorker::threadCount() << "I/O threads";
+
+    disconnect(connection);
+    qDeleteAll(devices);
+}
+
+void LanLinkProviderTest::manySimultaneousAnnouncements()
+{
+    //More devices announce themselves at once than handshakes we run at the same time, we connect to all of
+    //them and the event loop keeps running while we do. How long it went without running is only reported,
+    //it depends on how busy the machine is.
+    const int deviceCount = 50;
+    //They all come from localhost
+    m_lanLinkProvider.setAnnouncementRateLimit(deviceCount, LanLinkProvider::ANNOUNCEMENTS_PER_SECOND);
+    QSet<QString> connectedDevices;
+    QMetaObject::Connection connection = connect(&m_lanLinkProvider, &LinkProvider::onConnectionReceived, this,
+            [&connectedDevices](const NetworkPacket& identityPacket, DeviceLink*) {
+        connectedDevices.insert(identityPacket.get<QString>(QStringLiteral("deviceId")));
+    });
+
+    QElapsedTimer sinceLastTick;
+    qint64 longestStall = 0;
+    int ticks = 0;
+    QTimer ticker;
+    ticker.setInterval(10);
+    connect(&ticker, &QTimer::timeout, this, [&]() {
+        longestStall = qMax(longestStall, sinceLastTick.restart());
+        if (connectedDevices.size() < deviceCount) {
+            ++ticks;
+        }
+    });
+    sinceLastTick.start();
+    ticker.start();
+
+    QVector<Server*> servers;
+    QVector<QSslSocket*> sockets;
+    QUdpSocket udpSocket;
+    for (int i = 0; i < deviceCount; ++i) {
+        Server* server = new Server(this);
+        QVERIFY(server->listen(QHostAddress::LocalHost, 0));
+        connect(server, &QTcpServer::newConnection, this, [this, server, &sockets]() {
+            while (server->hasPendingConnections()) {
+                QSslSocket* socket = server->nextPendingConnection();
+                sockets.append(socket);
+                //Our identity comes first, then the announcer is the TLS client
+                connect(socket, &QIODevice::readyRead, this, [this, socket]() {
+                    if (socket->mode() != QSslSocket::UnencryptedMode || !socket->canReadLine()) {
+                        return;
+                    }
+                    socket->readLine();
+                    setSocketAttributes(socket);
+                    socket->setPeerVerifyMode(QSslSocket::QueryPeer);
+                    socket->startClientEncryption();
+                });
+            }
+        });
+        servers.append(server);
+
+        const QByteArray identity = identityPacket(QStringLiteral("announcer%1").arg(i), QStringLiteral("Announcer %1").arg(i), server->serverPort());
+        QCOMPARE(udpSocket.writeDatagram(identity, QHostAddress::LocalHost, LanLinkProvider::UDP_PORT), qint64(identity.size()));
+    }
+
+    QTRY_COMPARE_WITH_TIMEOUT(connectedDevices.size(), deviceCount, 60000);
+    qDebug() << deviceCount << "announcers connected, the longest the event loop went without running was" << longestStall << "ms";
+    QVERIFY(ticks > 0);
+
+    disconnect(connection);
+    qDeleteAll(sockets);
+    qDeleteAll(servers);
+    m_lanLinkProvider.setAnnouncementRateLimit(LanLinkProvider::ANNOUNCEMENT_BURST, LanLinkProvider::ANNOUNCEMENTS_PER_SECOND);
+}
+
+void LanLinkProviderTest::handshakeStorm()
+{
+    QUdpSocket udpSocket;
+    auto announce = [&udpSocket](const QString& deviceId, quint16 tcpPort) {
+        const QByteArray identity = identityPacket(deviceId, QStringLiteral("Storm"), tcpPort);
+        return udpSocket.writeDatagram(identity, QHostAddress::LocalHost, LanLinkProvider::UDP_PORT) == identity.size();
+    };
+
+    //Repeated announcements from 10 devices that accept the connection and then never answer: the table
+    //takes as many as it has room for once each, and empties itself when they time out
+    QTRY_COMPARE(m_lanLinkProvider.pendingHandshakes(), 0);
+    m_lanLinkProvider.setHandshakeLimits(8, 1000);
+    m_lanLinkProvider.setAnnouncementRateLimit(1000, LanLinkProvider::ANNOUNCEMENTS_PER_SECOND);
+
+    Server silentServer;
+    QVERIFY(silentServer.listen(QHostAddress::LocalHost, 0));
+    LanLinkProvider::HandshakeCounters before = m_lanLinkProvider.handshakeCounters();
+    for (int i = 0; i < 30; ++i) {
+        QVERIFY(announce(QStringLiteral("storm%1").arg(i % 10), silentServer.serverPort()));
+    }
+    QTRY_COMPARE(m_lanLinkProvider.handshakeCounters().announcements - before.announcements, quint64(30));
+    LanLinkProvider::HandshakeCounters after = m_lanLinkProvider.handshakeCounters();
+    QCOMPARE(after.accepted - before.accepted, quint64(8));
+    QCOMPARE(after.duplicates - before.duplicates, quint64(16));
+    QCOMPARE(after.tableFull - before.tableFull, quint64(6));
+    QVERIFY(m_lanLinkProvider.pendingHandshakes() <= 8);
+
+    QTRY_COMPARE_WITH_TIMEOUT(m_lanLinkProvider.handshakeCounters().timedOut - before.timedOut, quint64(8), 5000);
+    QCOMPARE(m_lanLinkProvider.pendingHandshakes(), 0);
+
+    //A single address sending announcements for many devices only gets its burst through
+    m_lanLinkProvider.setHandshakeLimits(LanLinkProvider::MAX_PENDING_HANDSHAKES, 1000);
+    m_lanLinkProvider.setAnnouncementRateLimit(5, 1);
+    before = m_lanLinkProvider.handshakeCounters();
+    for (int i = 0; i < 20; ++i) {
+        //Nothing listens on the tcp port we announce
+        QVERIFY(announce(QStringLiteral("flood%1").arg(i), 1));
+    }
+    QTRY_COMPARE(m_lanLinkProvider.handshakeCounters().announcements - before.announcements, quint64(20));
+    after = m_lanLinkProvider.handshakeCounters();
+    QVERIFY(after.rateLimited - before.rateLimited >= 14);
+    QVERIFY(after.accepted - before.accepted <= 6);
+
+    QTRY_COMPARE_WITH_TIMEOUT(m_lanLinkProvider.pendingHandshakes(), 0, 5000);
+
+    //Connections to our TCP port that never send their identity take room in the table too, and time out
+    QUdpSocket udpServer;
+    QVERIFY(udpServer.bind(QHostAddress::LocalHost, LanLinkProvider::UDP_PORT, QUdpSocket::ShareAddress));
+    QSignalSpy broadcastSpy(&udpServer, SIGNAL(readyRead()));
+    m_lanLinkProvider.onNetworkChange();
+    QVERIFY(!broadcastSpy.isEmpty() || broadcastSpy.wait());
+    QByteArray datagram;
+    datagram.resize(udpServer.pendingDatagramSize());
+    udpServer.readDatagram(datagram.data(), datagram.size());
+    const int tcpPort = QJsonDocument::fromJson(datagram).object().value(QStringLiteral("body")).toObject().value(QStringLiteral("tcpPort")).toInt();
+
+    m_lanLinkProvider.setHandshakeLimits(8, 1000);
+    before = m_lanLinkProvider.handshakeCounters();
+    QVector<QTcpSocket*> silentClients;
+    for (int i = 0; i < 12; ++i) {
+        QTcpSocket* client = new QTcpSocket(this);
+        client->connectToHost(QHostAddress::LocalHost, tcpPort);
+        silentClients.append(client);
+    }
+    QTRY_COMPARE(m_lanLinkProvider.handshakeCounters().tableFull - before.tableFull, quint64(4));
+    QCOMPARE(m_lanLinkProvider.pendingHandshakes(), 8);
+    QTRY_COMPARE_WITH_TIMEOUT(m_lanLinkProvider.handshakeCounters().timedOut - before.timedOut, quint64(8), 5000);
+    QCOMPARE(m_lanLinkProvider.pendingHandshakes(), 0);
+    for (QTcpSocket* client : qAsConst(silentClients)) {
+        QTRY_COMPARE(client->state(), QAbstractSocket::UnconnectedState);
+    }
+    qDeleteAll(silentClients);
+
+    m_lanLinkProvider.setHandshakeLimits(LanLinkProvider::MAX_PENDING_HANDSHAKES, LanLinkProvider::HANDSHAKE_TIMEOUT_MSECS);
+    m_lanLinkProvider.setAnnouncementRateLimit(LanLinkProvider::ANNOUNCEMENT_BURST, LanLinkProvider::ANNOUNCEMENTS_PER_SECOND);
+}
+
+void LanLinkProviderTest::linkedDeviceAnnouncements()
+{
+    //A device we just connected to announces itself a few more times, we keep the link it has
+    m_lanLinkProvider.setReconnectDebounce(LanLinkProvider::RECONNECT_DEBOUNCE_MSECS);
+    m_lanLinkProvider.setAnnouncementRateLimit(100, LanLinkProvider::ANNOUNCEMENTS_PER_SECOND);
+
+    int connections = 0;
+    QVector<QSslSocket*> sockets;
+    Server server;
+    QVERIFY(server.listen(QHostAddress::LocalHost, 0));
+    connect(&server, &QTcpServer::newConnection, this, [this, &server, &sockets, &connections]() {
+        while (server.hasPendingConnections()) {
+            QSslSocket* socket = server.nextPendingConnection();
+            sockets.append(socket);
+            ++connections;
+            connect(socket, &QIODevice::readyRead, this, [this, socket]() {
+                if (socket->mode() != QSslSocket::UnencryptedMode || !socket->canReadLine()) {
+                    return;
+                }
+                socket->readLine();
+                setSocketAttributes(socket);
+                socket->setPeerVerifyMode(QSslSocket::QueryPeer);
+                socket->startClientEncryption();
+            });
+        }
+    });
+
+    int linksReceived = 0;
+    QMetaObject::Connection connection = connect(&m_lanLinkProvider, &LinkProvider::onConnectionReceived, this,
+            [&linksReceived](const NetworkPacket& identityPacket, DeviceLink*) {
+        if (identityPacket.get<QString>(QStringLiteral("deviceId")) == QLatin1String("rebroadcaster")) {
+            ++linksReceived;
+        }
+    });
+
+    const QByteArray identity = identityPacket(QStringLiteral("rebroadcaster"), QStringLiteral("Rebroadcaster"), server.serverPort());
+    QUdpSocket udpSocket;
+    QCOMPARE(udpSocket.writeDatagram(identity, QHostAddress::LocalHost, LanLinkProvider::UDP_PORT), qint64(identity.size()));
+    QTRY_COMPARE(linksReceived, 1);
+
+    const LanLinkProvider::HandshakeCounters before = m_lanLinkProvider.handshakeCounters();
+    for (int i = 0; i < 5; ++i) {
+        QCOMPARE(udpSocket.writeDatagram(identity, QHostAddress::LocalHost, LanLinkProvider::UDP_PORT), qint64(identity.size()));
+    }
+    QTRY_COMPARE(m_lanLinkProvider.handshakeCounters().linked - before.linked, quint64(5));
+    QCOMPARE(m_lanLinkProvider.handshakeCounters().accepted, before.accepted);
+    QCOMPARE(connections, 1);
+
+    //Once the debounce is over the device can make us reconnect
+    m_lanLinkProvider.setReconnectDebounce(0);
+    QCOMPARE(udpSocket.writeDatagram(identity, QHostAddress::LocalHost, LanLinkProvider::UDP_PORT), qint64(identity.size()));
+    QTRY_COMPARE(linksReceived, 2);
+    QCOMPARE(connections, 2);
+
+    disconnect(connection);
+    qDeleteAll(sockets);
+    m_lanLinkProvider.setAnnouncementRateLimit(LanLinkProvider::ANNOUNCEMENT_BURST, LanLinkProvider::ANNOUNCEMENTS_PER_SECOND);
+}
+
 void LanLinkProviderTest::testIdentityPacket(QByteArray& identityPacket)
 {
     QJsonDocument jsonDocument = QJsonDocument::fromJson(identityPacket);
@@ -331,6 +872,14 @@ QSslCertificate LanLinkProviderTest::generateCertificate(QString& commonName, QC
     return certificate;
 }
 
+//The identity a phone running the current protocol sends, as it goes over the wire
+QByteArray LanLinkProviderTest::identityPacket(const QString& deviceId, const QString& deviceName, quint16 tcpPort)
+{
+    return QStringLiteral("{\"id\":1,\"type\":\"kdeconnect.identity\",\"body\":{\"deviceId\":\"%1\","
+                          "\"deviceName\":\"%2\",\"protocolVersion\":%3,\"deviceType\":\"phone\",\"tcpPort\":%4,\"tlsProfiles\":[\"modern\"]}}\n")
+               .arg(deviceId, deviceName).arg(NetworkPacket::s_protocolVersion).arg(tcpPort).toLatin1();
+}
+
 void LanLinkProviderTest::setSocketAttributes(QSslSocket* socket)
 {
     socket->setPrivateKey(QSslKey(m_privateKey.toPEM().toLatin1(), QSsl::Rsa));
@@ -21,12 +21,25 @@
 #include "networkpackettests.h"
 
 #include "core/networkpacket.h"
+#include "mousepad_packets.h"
 
 #include <QtTest>
 #include <QtCrypto>
 
 QTEST_GUILESS_MAIN(NetworkPacketTests);
 
+//What NetworkPacket::serialize used to do: build a QVariantMap and run it through QJsonDocument
+static QByteArray variantSerialize(const NetworkPacket& np)
+{
+    QVariantMap variant;
+    variant[QStringLiteral("id")] = np.id();
+    variant[QStringLiteral("type")] = np.type();
+    variant[QStringLiteral("body")] = np.body();
+    variant[QStringLiteral("payloadSize")] = np.payloadSize();
+    variant[QStringLiteral("payloadTransferInfo")] = np.payloadTransferInfo();
+    return QJsonDocument::fromVariant(variant).toJson(QJsonDocument::Compact) + '\n';
+}
+
 void NetworkPacketTests::initTestCase()
 {
     // Called before the first testfunction is executed
@@ -63,6 +76,13 @@ void NetworkPacketTests::networkPacketTest()
     QCOMPARE( (np2.get<bool>("not_testing")), false );
     QCOMPARE( (np2.get<bool>("not_testing",true)), true );
 
+    QByteArray identity("{\"id\":1439365924847,\"type\":\"kdeconnect.identity\",\"body\":{\"deviceId\":\"test-device\"},\"payloadSize\":5000000000,\"payloadTransferInfo\":{\"port\":1739}}");
+    QVERIFY( NetworkPacket::unserialize(identity,&np2) );
+    QCOMPARE( np2.id(), QString("1439365924847") );
+    QCOMPARE( (np2.get<QString>("deviceId")), QString("test_device") );
+    QCOMPARE( np2.payloadSize(), Q_INT64_C(5000000000) );
+    QCOMPARE( np2.payloadTransferInfo().value("port").toInt(), 1739 );
+
     //NetworkPacket::unserialize("this is not json",&np2);
     //QtTest::ignoreMessage(QtSystemMsg, "json_parser - syntax error found,  forcing abort, Line 1 Column 0");
     //QtTest::ignoreMessage(QtDebugMsg, "Unserialization error: 1 \"syntax error, unexpected string\"");
@@ -77,6 +97,331 @@ void NetworkPacketTests::networkPacketIdentityTest()
     QCOMPARE( np.get<int>("protocolVersion", -1) , NetworkPacket::s_protocolVersion );
     QCOMPARE( np.type() , PACKET_TYPE_IDENTITY );
 
+    //The body is cached, but every identity packet still gets its own id
+    NetworkPacket np2(QLatin1String(""));
+    NetworkPacket::createIdentityPacket(&np2);
+    QVERIFY( np2.body().isSharedWith(np.body()) );
+    QVERIFY( np2.id() != np.id() );
+
+    //Changes made to one packet don't leak into the cache
+    np2.set(QStringLiteral("tcpPort"), 1716);
+    NetworkPacket np3(QLatin1String(""));
+    NetworkPacket::createIdentityPacket(&np3);
+    QVERIFY( !np3.has(QStringLiteral("tcpPort")) );
+
+    NetworkPacket::invalidateIdentityPacket();
+    NetworkPacket np4(QLatin1String(""));
+    NetworkPacket::createIdentityPacket(&np4);
+    QVERIFY( !np4.body().isSharedWith(np.body()) );
+    QCOMPARE( np4.body(), np.body() );
+}
+
+void NetworkPacketTests::networkPacketSerializeBenchmark_data()
+{
+    QTest::addColumn<bool>("direct");
+
+    QTest::newRow("QVariant round trip") << false;
+    QTest::newRow("direct writer") << true;
+}
+
+void NetworkPacketTests::networkPacketSerializeBenchmark()
+{
+    QFETCH(bool, direct);
+
+    NetworkPacket np(QStringLiteral("kdeconnect.mpris"));
+    np.set(QStringLiteral("player"), QStringLiteral("VLC media player"));
+    np.set(QStringLiteral("nowPlaying"), QStringLiteral("Artist \"Quoted\" - Títle\twith\nescapes"));
+    np.set(QStringLiteral("title"), QStringLiteral("Títle"));
+    np.set(QStringLiteral("artist"), QStringLiteral("Artist"));
+    np.set(QStringLiteral("isPlaying"), true);
+    np.set(QStringLiteral("pos"), 123456);
+    np.set(QStringLiteral("length"), 234567);
+    np.set(QStringLiteral("volume"), 0.75);
+    np.set(QStringLiteral("playerList"), QStringList{QStringLiteral("VLC media player"), QStringLiteral("Spotify")});
+
+    QByteArray json;
+    if (direct) {
+        QBENCHMARK {
+            json.clear();
+            np.serialize(json);
+        }
+    } else {
+        QBENCHMARK {
+            json = variantSerialize(np);
+        }
+    }
+
+    //Both writers have to describe the same packet, payloadSize and payloadTransferInfo included
+    const QJsonObject written = QJsonDocument::fromJson(json).object();
+    QCOMPARE(written, QJsonDocument::fromJson(variantSerialize(np)).object());
+    QVERIFY(written.contains(QStringLiteral("payloadSize")));
+    QVERIFY(written.contains(QStringLiteral("payloadTransferInfo")));
+    QVERIFY(json.endsWith('\n'));
+}
+
+void NetworkPacketTests::networkPacketLazyBodyTest()
+{
+    QByteArray json("{\"id\":\"1\",\"type\":\"test\",\"body\":{\"a\":1,\"b\":\"two\",\"c\":[3]}}");
+    NetworkPacket np(QLatin1String(""));
+    QVERIFY( NetworkPacket::unserialize(json,&np) );
+
+    QVERIFY( np.has("c") );
+    QVERIFY( !np.has("d") );
+    QCOMPARE( (np.get<int>("a")), 1 );
+    QCOMPARE( (np.get<QString>("b")), QString("two") );
+    QCOMPARE( (np.get<QString>("d", "default")), QString("default") );
+
+    //Fields written locally win over the ones still waiting to be decoded
+    np.set(QStringLiteral("c"), 4);
+    QCOMPARE( (np.get<int>("c")), 4 );
+    QCOMPARE( np.body().size(), 3 );
+    QCOMPARE( np.body().value("c").toInt(), 4 );
+
+    NetworkPacket np2(QLatin1String(""));
+    QVERIFY( NetworkPacket::unserialize(np.serialize(),&np2) );
+    QCOMPARE( (np2.get<int>("c")), 4 );
+    QCOMPARE( (np2.get<QString>("b")), QString("two") );
+}
+
+void NetworkPacketTests::networkPacketTypeIdTest()
+{
+    const int pingId = NetworkPacket::registerType(QStringLiteral("kdeconnect.test.ping"));
+    const int otherId = NetworkPacket::registerType(QStringLiteral("kdeconnect.test.other"));
+    QVERIFY( pingId >= 0 );
+    QVERIFY( pingId != otherId );
+    QCOMPARE( NetworkPacket::registerType(QStringLiteral("kdeconnect.test.ping")), pingId );
+
+    NetworkPacket np(QStringLiteral("kdeconnect.test.ping"));
+    QCOMPARE( np.typeId(), pingId );
+
+    NetworkPacket::unserialize("{\"id\":\"1\",\"type\":\"kdeconnect.test.other\",\"body\":{}}", &np);
+    QCOMPARE( np.typeId(), otherId );
+
+    NetworkPacket::unserialize("{\"id\":\"1\",\"type\":\"kdeconnect.test.unknown\",\"body\":{}}", &np);
+    QCOMPARE( np.typeId(), int(NetworkPacket::UnknownTypeId) );
+}
+
+void NetworkPacketTests::networkPacketIdTest()
+{
+    //Packets created back to back, within the same millisecond, still get different and increasing ids
+    qint64 previousId = NetworkPacket(QStringLiteral("com.test")).id().toLongLong();
+    for (int i = 0; i < 1000; ++i) {
+        const qint64 id = NetworkPacket(QStringLiteral("com.test")).id().toLongLong();
+        QVERIFY( id > previousId );
+        previousId = id;
+    }
+
+    NetworkPacket np(QStringLiteral("com.test"));
+    const QJsonObject json = QJsonDocument::fromJson(np.serialize()).object();
+    QCOMPARE( json.value(QStringLiteral("id")).toString(), np.id() );
+
+    NetworkPacket np2(QLatin1String(""));
+    NetworkPacket::unserialize("{\"id\":\"custom-id\",\"type\":\"test\",\"body\":{}}", &np2);
+    QCOMPARE( np2.id(), QString("custom-id") );
+
+    //An id that came as a number is written back as a number, one that came as a string as a string
+    NetworkPacket::unserialize("{\"id\":1439365924847,\"type\":\"test\",\"body\":{}}", &np2);
+    QCOMPARE( np2.id(), QString("1439365924847") );
+    QCOMPARE( QJsonDocument::fromJson(np2.serialize()).object().value(QStringLiteral("id")), QJsonValue(1439365924847.0) );
+    NetworkPacket::unserialize("{\"id\":\"1439365924847\",\"type\":\"test\",\"body\":{}}", &np2);
+    QCOMPARE( QJsonDocument::fromJson(np2.serialize()).object().value(QStringLiteral("id")), QJsonValue(QStringLiteral("1439365924847")) );
+
+    //A packet without an id doesn't keep the one np2 had before
+    NetworkPacket::unserialize("{\"id\":1439365924847,\"type\":\"test\",\"body\":{}}", &np2);
+    QVERIFY( NetworkPacket::unserialize("{\"type\":\"test\",\"body\":{}}", &np2) );
+    QCOMPARE( np2.id(), QString() );
+    QCOMPARE( QJsonDocument::fromJson(np2.serialize()).object().value(QStringLiteral("id")), QJsonValue(QString()) );
+}
+
+void NetworkPacketTests::networkPacketCborTest()
+{
+    if (!NetworkPacket::cborSupported()) {
+        QSKIP("Built without QCbor support");
+    }
+
+    NetworkPacket np(QStringLiteral("kdeconnect.battery"));
+    np.set(QStringLiteral("currentCharge"), 42);
+    np.set(QStringLiteral("isCharging"), true);
+    np.set(QStringLiteral("deviceId"), QStringLiteral("some-device"));
+    np.set(QStringLiteral("list"), QStringList{QStringLiteral("a"), QStringLiteral("b")});
+
+    const QByteArray cbor = np.serializeCbor();
+    QVERIFY( !cbor.contains('{') );
+
+    NetworkPacket np2(QLatin1String(""));
+    QVERIFY( NetworkPacket::unserialize(cbor,&np2) );
+    QCOMPARE( np2.id(), np.id() );
+    QCOMPARE( np2.type(), np.type() );
+    QCOMPARE( (np2.get<int>("currentCharge")), 42 );
+    QCOMPARE( (np2.get<bool>("isCharging")), true );
+    QCOMPARE( (np2.get<QString>("deviceId")), QString("some_device") );
+    QCOMPARE( (np2.get<QStringList>("list")), (QStringList{QStringLiteral("a"), QStringLiteral("b")}) );
+
+    NetworkPacket identity(QLatin1String(""));
+    NetworkPacket::createIdentityPacket(&identity);
+    QVERIFY( (identity.get<QStringList>("packetEncodings")).contains(QStringLiteral("cbor")) );
+
+    //A numeric id stays numeric through CBOR too
+    NetworkPacket numericId(QLatin1String(""));
+    QVERIFY( NetworkPacket::unserialize("{\"id\":1439365924847,\"type\":\"test\",\"body\":{}}", &numericId) );
+    QVERIFY( NetworkPacket::unserialize(numericId.serializeCbor(), &np2) );
+    QCOMPARE( QJsonDocument::fromJson(np2.serialize()).object().value(QStringLiteral("id")), QJsonValue(1439365924847.0) );
+}
+
+void NetworkPacketTests::networkPacketNoPayloadTest_data()
+{
+    QTest::addColumn<bool>("cbor");
+
+    QTest::newRow("json") << false;
+    QTest::newRow("cbor") << true;
+}
+
+void NetworkPacketTests::networkPacketNoPayloadTest()
+{
+    QFETCH(bool, cbor);
+    if (cbor && !NetworkPacket::cborSupported()) {
+        QSKIP("Built without QCbor support");
+    }
+
+    //Both encodings write payloadSize and payloadTransferInfo for packets without a payload too
+    NetworkPacket np(QStringLiteral("kdeconnect.ping"));
+    QVERIFY( !np.hasPayload() );
+    const QByteArray data = cbor? np.serializeCbor() : np.serialize();
+    QVERIFY( data.contains("payloadSize") );
+    QVERIFY( data.contains("payloadTransferInfo") );
+
+    NetworkPacket np2(QLatin1String(""));
+    np2.setPayloadTransferInfo({{QStringLiteral("port"), 1739}});
+    QVERIFY( NetworkPacket::unserialize(data, &np2) );
+    QCOMPARE( np2.type(), np.type() );
+    QVERIFY( !np2.hasPayload() );
+    QVERIFY( !np2.hasPayloadTransferInfo() );
+}
+
+void NetworkPacketTests::networkPacketEncodingBenchmark_data()
+{
+    QTest::addColumn<bool>("cbor");
+
+    QTest::newRow("json") << false;
+    QTest::newRow("cbor") << true;
+}
+
+void NetworkPacketTests::networkPacketEncodingBenchmark()
+{
+    QFETCH(bool, cbor);
+    if (cbor && !NetworkPacket::cborSupported()) {
+        QSKIP("Built without QCbor support");
+    }
+
+    NetworkPacket np(QStringLiteral("kdeconnect.mpris"));
+    np.set(QStringLiteral("player"), QStringLiteral("VLC media player"));
+    np.set(QStringLiteral("pos"), 123456);
+    np.set(QStringLiteral("isPlaying"), true);
+
+    int size = 0;
+    QBENCHMARK {
+        const QByteArray data = cbor? np.serializeCbor() : np.serialize();
+        NetworkPacket np2(QString::null);
+        NetworkPacket::unserialize(data, &np2);
+        QCOMPARE( (np2.get<int>("pos")), 123456 );
+        size = data.size();
+    }
+    qDebug() << (cbor? "cbor" : "json") << "packet size:" << size;
+}
+
+void NetworkPacketTests::networkPacketMousepadBenchmark_data()
+{
+    QTest::addColumn<bool>("lazy");
+    QTest::addColumn<bool>("generated");
+
+    QTest::newRow("decode whole body") << false << false;
+    QTest::newRow("decode on first read") << true << false;
+    QTest::newRow("generated decoder") << true << true;
+}
+
+void NetworkPacketTests::networkPacketMousepadBenchmark()
+{
+    QFETCH(bool, lazy);
+    QFETCH(bool, generated);
+
+    //What a phone sends while the finger moves over the touchpad, read the way X11RemoteInput reads it
+    const QByteArray json("{\"id\":\"1439365924847\",\"type\":\"kdeconnect.mousepad.request\",\"body\":{\"dx\":3.5,\"dy\":-1.25}}\n");
+    const int packetsPerIteration = 1000;
+
+    QBENCHMARK {
+        for (int i = 0; i < packetsPerIteration; ++i) {
+            NetworkPacket np(QString::null);
+            NetworkPacket::unserialize(json, &np);
+            if (!lazy) {
+                np.body();
+            }
+            if (generated) {
+                MousepadRequest request;
+                QVERIFY(request.decode(np));
+                QVERIFY(request.dx == 3.5 && request.dy == -1.25);
+                QVERIFY(!(request.singleclick || request.doubleclick || request.middleclick || request.rightclick || request.singlehold || request.singlerelease || request.scroll));
+                QVERIFY(request.key.isEmpty() && request.specialKey == 0);
+                continue;
+            }
+            const float dx = np.get<float>(QStringLiteral("dx"), 0);
+            const float dy = np.get<float>(QStringLiteral("dy"), 0);
+            const bool isSingleClick = np.get<bool>(QStringLiteral("singleclick"), false);
+            const bool isDoubleClick = np.get<bool>(QStringLiteral("doubleclick"), false);
+            const bool isMiddleClick = np.get<bool>(QStringLiteral("middleclick"), false);
+            const bool isRightClick = np.get<bool>(QStringLiteral("rightclick"), false);
+            const bool isSingleHold = np.get<bool>(QStringLiteral("singlehold"), false);
+            const bool isSingleRelease = np.get<bool>(QStringLiteral("singlerelease"), false);
+            const bool isScroll = np.get<bool>(QStringLiteral("scroll"), false);
+            const QString key = np.get<QString>(QStringLiteral("key"), QLatin1String(""));
+            const int specialKey = np.get<int>(QStringLiteral("specialKey"), 0);
+            QVERIFY(dx == 3.5f && dy == -1.25f);
+            QVERIFY(!(isSingleClick || isDoubleClick || isMiddleClick || isRightClick || isSingleHold || isSingleRelease || isScroll));
+            QVERIFY(key.isEmpty() && specialKey == 0);
+        }
+    }
+}
+
+void NetworkPacketTests::networkPacketSchemaTest()
+{
+    MousepadRequest request;
+
+    //Fields come from the wire, the ones missing keep their defaults and unknown ones are ignored
+    NetworkPacket received(QString::null);
+    QVERIFY(NetworkPacket::unserialize("{\"id\":1,\"type\":\"kdeconnect.mousepad.request\",\"body\":{\"dx\":2,\"key\":\"a\",\"ctrl\":true,\"whatever\":[1]}}\n", &received));
+    QVERIFY(request.decode(received));
+    QCOMPARE(request.dx, 2.0);
+    QCOMPARE(request.dy, 0.0);
+    QCOMPARE(request.key, QStringLiteral("a"));
+    QVERIFY(request.ctrl);
+    QVERIFY(!request.shift);
+
+    //Packets built locally work as well
+    MousepadRequest local;
+    QVERIFY(local.decode(NetworkPacket(MousepadRequest::packetType(), {{QStringLiteral("specialKey"), 12}, {QStringLiteral("scroll"), true}})));
+    QCOMPARE(local.specialKey, 12);
+    QVERIFY(local.scroll);
+
+    //Numbers are taken for bools, some clients send those
+    NetworkPacket numericBool(QString::null);
+    QVERIFY(NetworkPacket::unserialize("{\"id\":1,\"type\":\"kdeconnect.mousepad.request\",\"body\":{\"singleclick\":1,\"specialKey\":3.0}}\n", &numericBool));
+    MousepadRequest clicked;
+    QVERIFY(clicked.decode(numericBool));
+    QVERIFY(clicked.singleclick);
+    QCOMPARE(clicked.specialKey, 3);
+
+    //Anything else with the wrong type makes the whole packet invalid
+    const QList<QByteArray> mistyped = {
+        "{\"dx\":\"2\"}", "{\"dy\":[1]}", "{\"ctrl\":\"true\"}", "{\"key\":5}",
+        "{\"specialKey\":3.5}", "{\"specialKey\":1e20}",
+    };
+    for (const QByteArray& body : mistyped) {
+        NetworkPacket malformed(QString::null);
+        QVERIFY(NetworkPacket::unserialize("{\"id\":1,\"type\":\"kdeconnect.mousepad.request\",\"body\":" + body + "}\n", &malformed));
+        QVERIFY2(!MousepadRequest().decode(malformed), body.constData());
+    }
+
+    //Other packet types are rejected
+    QVERIFY(!MousepadRequest().decode(NetworkPacket(QStringLiteral("kdeconnect.ping"))));
 }
 
 void NetworkPacketTests::cleanupTestCase()
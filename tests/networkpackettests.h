@@ -32,6 +32,19 @@ private Q_SLOTS:
 
     void networkPacketTest();
     void networkPacketIdentityTest();
+    void networkPacketSerializeBenchmark_data();
+    void networkPacketSerializeBenchmark();
+    void networkPacketLazyBodyTest();
+    void networkPacketTypeIdTest();
+    void networkPacketIdTest();
+    void networkPacketCborTest();
+    void networkPacketNoPayloadTest_data();
+    void networkPacketNoPayloadTest();
+    void networkPacketEncodingBenchmark_data();
+    void networkPacketEncodingBenchmark();
+    void networkPacketMousepadBenchmark_data();
+    void networkPacketMousepadBenchmark();
+    void networkPacketSchemaTest();
     //void networkPacketEncryptionTest();
 
     void cleanupTestCase();
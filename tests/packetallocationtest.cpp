@@ -0,0 +1,176 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "../core/networkpacket.h"
+#include "../core/backends/loopback/loopbacklinkprovider.h"
+#include "../core/backends/loopback/loopbackdevicelink.h"
+
+#include <QtTest>
+
+#include <cstdlib>
+#include <new>
+
+//Counts every heap allocation made by this process while s_counting is set
+static bool s_counting = false;
+static int s_allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    if (s_counting) {
+        ++s_allocations;
+    }
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+static void startCounting()
+{
+    s_allocations = 0;
+    s_counting = true;
+}
+
+static int stopCounting()
+{
+    s_counting = false;
+    return s_allocations;
+}
+
+/**
+ * Checks that a packet body travels from the sender, through a link, to the receiver without being
+ * deep copied. Copying a body with BODY_SIZE entries would take at least BODY_SIZE allocations, so
+ * anything well below that means the body was shared or moved.
+ */
+class PacketAllocationTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void buildPacket();
+    void loopbackMove();
+    void loopbackCopy();
+    void cleanupTestCase();
+
+private:
+    QVariantMap makeBody() const;
+
+    static const int BODY_SIZE = 1000;
+    LoopbackLinkProvider* m_provider;
+};
+
+void PacketAllocationTest::initTestCase()
+{
+    m_provider = new LoopbackLinkProvider();
+
+    //Make sure the serialize() round trip the loopback link used to do really costs what we think it does
+    NetworkPacket np(QStringLiteral("kdeconnect.test"), makeBody());
+    const QByteArray serialized = np.serialize();
+    NetworkPacket output(QString::null);
+    startCounting();
+    NetworkPacket::unserialize(serialized, &output);
+    output.body();
+    const int allocations = stopCounting();
+    QVERIFY2(allocations > BODY_SIZE, qPrintable(QString::number(allocations)));
+}
+
+QVariantMap PacketAllocationTest::makeBody() const
+{
+    QVariantMap body;
+    for (int i = 0; i < BODY_SIZE; ++i) {
+        body.insert(QStringLiteral("key%1").arg(i), QStringLiteral("value%1").arg(i));
+    }
+    return body;
+}
+
+void PacketAllocationTest::buildPacket()
+{
+    QVariantMap body = makeBody();
+
+    startCounting();
+    NetworkPacket np(QStringLiteral("kdeconnect.test"), std::move(body));
+    NetworkPacket moved(std::move(np));
+    const int allocations = stopCounting();
+
+    QCOMPARE(moved.body().size(), BODY_SIZE);
+    QVERIFY2(allocations < BODY_SIZE / 10, qPrintable(QString::number(allocations)));
+}
+
+void PacketAllocationTest::loopbackMove()
+{
+    LoopbackDeviceLink link(QStringLiteral("loopback"), m_provider);
+    NetworkPacket np(QStringLiteral("kdeconnect.test"), makeBody());
+    const QVariantMap sentBody = np.body();
+
+    //What a plugin does with what it receives: look at the body and read fields out of it
+    bool shared = false;
+    QString lastValue;
+    connect(&link, &DeviceLink::receivedPacket, this, [&](const NetworkPacket& received) {
+        shared = received.body().isSharedWith(sentBody);
+        lastValue = received.get<QString>(QStringLiteral("key%1").arg(BODY_SIZE - 1));
+    });
+
+    startCounting();
+    QVERIFY(link.sendPacket(std::move(np)));
+    const int allocations = stopCounting();
+
+    QVERIFY(shared);
+    QCOMPARE(lastValue, QStringLiteral("value%1").arg(BODY_SIZE - 1));
+    QVERIFY2(allocations < BODY_SIZE / 10, qPrintable(QString::number(allocations)));
+}
+
+void PacketAllocationTest::loopbackCopy()
+{
+    LoopbackDeviceLink link(QStringLiteral("loopback"), m_provider);
+    NetworkPacket np(QStringLiteral("kdeconnect.test"), makeBody());
+
+    bool shared = false;
+    connect(&link, &DeviceLink::receivedPacket, this, [&](const NetworkPacket& received) {
+        shared = received.body().isSharedWith(np.body());
+    });
+
+    startCounting();
+    QVERIFY(link.sendPacket(np));
+    const int allocations = stopCounting();
+
+    QVERIFY(shared);
+    QVERIFY2(allocations < BODY_SIZE / 10, qPrintable(QString::number(allocations)));
+}
+
+void PacketAllocationTest::cleanupTestCase()
+{
+    delete m_provider;
+}
+
+QTEST_GUILESS_MAIN(PacketAllocationTest)
+
+#include "packetallocationtest.moc"
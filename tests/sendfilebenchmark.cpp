@@ -0,0 +1,142 @@
+/**
+ * Copyright 2026 The KDE Connect developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License or (at your option) version 3 or any later version
+ * accepted by the membership of KDE e.V. (or its successor approved
+ * by the membership of KDE e.V.), which shall act as a proxy
+ * defined in Section 14 of version 3 of the license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <backends/lan/downloadjob.h>
+#include <backends/lan/uploadjob.h>
+#include <core/filetransferjob.h>
+#include <kdeconnectconfig.h>
+#include <QApplication>
+#include <QDir>
+#include <QSignalSpy>
+#include <QStandardPaths>
+#include <QTemporaryFile>
+#include <QTest>
+
+#include <KIO/AccessManager>
+
+#include "testdaemon.h"
+
+/*
+ * Sends a file from an UploadJob to a DownloadJob over the loopback interface. Not part of the test
+ * suite, it writes a 2 GiB file to the temporary directory: run sendfilebenchmark by hand.
+ * KDECONNECT_BENCHMARK_MIB sets another size.
+ *
+ * The jobs are the ones a LanDeviceLink starts for a payload, but there are no LanLinkProviders in
+ * between: two of them in one process share the KdeConnectConfig device id, and each one ignores
+ * the identity of the other as its own. The link only sends the packet that announces the payload.
+ */
+class SendFileBenchmark : public QObject
+{
+    Q_OBJECT
+    public:
+        SendFileBenchmark() {
+            QStandardPaths::setTestModeEnabled(true);
+            m_daemon = new TestDaemon;
+        }
+
+    private Q_SLOTS:
+        void initTestCase()
+        {
+            m_size = qgetenv("KDECONNECT_BENCHMARK_MIB").isEmpty()? qint64(2048) * 1024 * 1024
+                     : qgetenv("KDECONNECT_BENCHMARK_MIB").toLongLong() * 1024 * 1024;
+
+            //Every MiB of the file is the same block
+            m_block.resize(1024 * 1024);
+            for (int i = 0; i < m_block.size(); ++i) {
+                m_block[i] = char(i % 251);
+            }
+            m_source.reset(new QTemporaryFile);
+            QVERIFY(m_source->open());
+            for (qint64 written = 0; written < m_size; written += m_block.size()) {
+                QVERIFY(m_source->write(m_block.constData(), qMin<qint64>(m_block.size(), m_size - written)) > 0);
+            }
+            m_source->close();
+
+            //Trusts our own certificate, so the jobs can talk to each other
+            KdeConnectConfig* kcc = KdeConnectConfig::instance();
+            m_deviceId = kcc->deviceId();
+            kcc->addTrustedDevice(m_deviceId, QStringLiteral("testdevice"), kcc->deviceType());
+            kcc->setDeviceProperty(m_deviceId, QStringLiteral("certificate"), QString::fromLatin1(kcc->certificate().toPem()));
+        }
+
+        void benchmarkSslJobs_data()
+        {
+            QTest::addColumn<int>("streams");
+            QTest::newRow("single connection") << 0;
+            QTest::newRow("4 ranges") << 4;
+        }
+
+        void benchmarkSslJobs()
+        {
+            QFETCH(int, streams);
+            const QString destFile = QDir::tempPath() + "/kdeconnect-test-benchmark";
+            QFile(destFile).remove();
+
+            FileTransferJob* ft = nullptr;
+            QBENCHMARK_ONCE {
+                UploadJob* uj = new UploadJob(m_source, m_deviceId);
+                if (streams > 0) {
+                    uj->setStreamCount(streams, m_size);
+                }
+                QSignalSpy spyUpload(uj, &KJob::result);
+                uj->start();
+                QVariantMap info = uj->transferInfo();
+                info.insert(QStringLiteral("deviceId"), m_deviceId);
+                info.insert(QStringLiteral("size"), m_size);
+                DownloadJob* dj = new DownloadJob(QHostAddress::LocalHost, info);
+                QVERIFY(dj->getPayload()->open(QIODevice::ReadOnly));
+                ft = new FileTransferJob(dj->getPayload(), m_size, QUrl::fromLocalFile(destFile));
+                ft->setAutoDelete(false);
+                QSignalSpy spyTransfer(ft, &KJob::result);
+                ft->start();
+                dj->start();
+
+                QVERIFY(spyTransfer.count() || spyTransfer.wait(600000));
+                QVERIFY(spyUpload.count() || spyUpload.wait(2000));
+            }
+            QCOMPARE(ft->error(), 0);
+            delete ft;
+
+            QFile resultFile(destFile);
+            QCOMPARE(resultFile.size(), m_size);
+            QVERIFY(resultFile.open(QIODevice::ReadOnly));
+            QCOMPARE(resultFile.read(m_block.size()), m_block);
+            QVERIFY(resultFile.seek(m_size - m_block.size()));
+            QCOMPARE(resultFile.read(m_block.size()), m_block);
+            resultFile.close();
+            resultFile.remove();
+        }
+
+        void cleanupTestCase()
+        {
+            KdeConnectConfig::instance()->removeTrustedDevice(m_deviceId);
+        }
+
+    private:
+        TestDaemon* m_daemon;
+        QSharedPointer<QTemporaryFile> m_source;
+        QByteArray m_block;
+        qint64 m_size;
+        QString m_deviceId;
+};
+
+QTEST_MAIN(SendFileBenchmark);
+
+#include "sendfilebenchmark.moc"
@@ -22,11 +22,18 @@
 #include <backends/lan/downloadjob.h>
 #include <kdeconnectconfig.h>
 #include <backends/lan/uploadjob.h>
+#include <backends/lan/lanlinkprovider.h>
 #include <core/filetransferjob.h>
 #include <QApplication>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QNetworkAccessManager>
+#include <QPointer>
 #include <QTest>
 #include <QTemporaryFile>
+#include <QTimer>
 #include <QSignalSpy>
 #include <QStandardPaths>
 
@@ -140,7 +147,219 @@ class TestSendFile : public QObject
             QCOMPARE(resultFile.readAll(), originFile.readAll());
         }
 
+        void benchmarkTlsProfiles_data()
+        {
+            QTest::addColumn<int>("profile");
+            QTest::newRow("legacy") << int(LanLinkProvider::LegacySslProfile);
+            QTest::newRow("modern") << int(LanLinkProvider::ModernSslProfile);
+        }
+
+        void benchmarkTlsProfiles()
+        {
+            QFETCH(int, profile);
+            const qint64 size = 64 * 1024 * 1024;
+            const QString destFile = QDir::tempPath() + "/kdeconnect-test-tlsprofile";
+            QFile(destFile).remove();
+
+            const QString deviceId = trustSelf();
+            LanLinkProvider::setPeerSslProfile(deviceId, LanLinkProvider::SslProfile(profile));
+
+            const QSharedPointer<QTemporaryFile> source = createSource(size);
+            QVERIFY(source);
+
+            QElapsedTimer timer;
+            timer.start();
+            const Transfer transfer = prepareTransfer(new UploadJob(source, deviceId), deviceId, size, destFile);
+            QSharedPointer<QSslSocket> socket = transfer.download->getPayload().staticCast<QSslSocket>();
+            QString cipher;
+            connect(socket.data(), &QSslSocket::encrypted, this, [&]() { cipher = socket->sessionCipher().name(); });
+            FileTransferJob* ft = transfer.transfer;
+            QSignalSpy spyTransfer(ft, &KJob::result);
+            ft->start();
+            transfer.download->start();
+
+            QTRY_VERIFY_WITH_TIMEOUT(!cipher.isEmpty() || socket->state() == QAbstractSocket::UnconnectedState, 10000);
+            LanLinkProvider::setPeerSslProfile(deviceId, LanLinkProvider::LegacySslProfile);
+            if (cipher.isEmpty()) {
+                QSKIP("The TLS library refused the handshake with this profile");
+            }
+            QVERIFY(spyTransfer.count() || spyTransfer.wait(600000));
+            QCOMPARE(ft->error(), 0);
+            const qint64 elapsed = qMax<qint64>(timer.elapsed(), 1);
+            qDebug() << QTest::currentDataTag() << "profile negotiated" << cipher << "and transferred"
+                     << (size / 1024 / 1024) * 1000 / elapsed << "MiB/s";
+            QCOMPARE(QFile(destFile).size(), size);
+            QFile(destFile).remove();
+        }
+
+        void resumeSslJobs()
+        {
+            const qint64 size = 8 * 1024 * 1024;
+            const QString destFile = QDir::tempPath() + "/kdeconnect-test-resumed";
+            QFile(destFile).remove();
+
+            const QString deviceId = trustSelf();
+
+            QByteArray content(size, Qt::Uninitialized);
+            for (int i = 0; i < content.size(); ++i) {
+                content[i] = char(i % 253);
+            }
+            const QSharedPointer<QTemporaryFile> source = createSource(size, content);
+            QVERIFY(source);
+
+            UploadJob* uj = new UploadJob(source, deviceId);
+            uj->setStreamCount(2, size);
+            QSignalSpy spyUpload(uj, &KJob::result);
+            //The partial state is only loaded once the transfer job starts
+            const Transfer transfer = prepareTransfer(uj, deviceId, size, destFile);
+            const QString contentId = transfer.info.value(QStringLiteral("contentId")).toString();
+            QVERIFY(!contentId.isEmpty());
+
+            //What an interrupted transfer of the same file leaves behind: the first 3 MiB and the last one
+            QFile partialFile(destFile + ".part");
+            QVERIFY(partialFile.open(QIODevice::WriteOnly));
+            partialFile.write(content.left(3 * 1024 * 1024));
+            partialFile.resize(size);
+            partialFile.seek(size - 1024 * 1024);
+            partialFile.write(content.right(1024 * 1024));
+            partialFile.close();
+            const QJsonObject state{
+                {QStringLiteral("size"), size},
+                {QStringLiteral("contentId"), contentId},
+                {QStringLiteral("missing"), QJsonArray{QJsonArray{3 * 1024 * 1024, 4 * 1024 * 1024}}}
+            };
+            QFile stateFile(destFile + ".part.state");
+            QVERIFY(stateFile.open(QIODevice::WriteOnly));
+            stateFile.write(QJsonDocument(state).toJson());
+            stateFile.close();
+
+            FileTransferJob* ft = transfer.transfer;
+            QSignalSpy spyTransfer(ft, &KJob::result);
+            ft->start();
+            transfer.download->start();
+
+            QVERIFY(spyTransfer.count() || spyTransfer.wait(60000));
+            QCOMPARE(ft->error(), 0);
+            QVERIFY(spyUpload.count() || spyUpload.wait(2000));
+            QCOMPARE(uj->error(), 0);
+
+            //Only the missing part was sent
+            QCOMPARE(qint64(uj->processedAmount(KJob::Bytes)), qint64(4 * 1024 * 1024));
+            QVERIFY(!QFile::exists(destFile + ".part"));
+            QVERIFY(!QFile::exists(destFile + ".part.state"));
+            QFile resultFile(destFile);
+            QVERIFY(resultFile.open(QIODevice::ReadOnly));
+            QVERIFY(resultFile.readAll() == content);
+            resultFile.close();
+            resultFile.remove();
+        }
+
+        void uploadKeepsEventLoopResponsive()
+        {
+            const qint64 size = 32 * 1024 * 1024;
+            const QString destFile = QDir::tempPath() + "/kdeconnect-test-latency";
+            QFile(destFile).remove();
+
+            const QString deviceId = trustSelf();
+
+            const QSharedPointer<QTemporaryFile> source = createSource(size);
+            QVERIFY(source);
+
+            //The upload must give the event loop back between chunks, so a timer gets to run while it's sending.
+            //How long the loop went without running it is only reported, it depends on how busy the machine is.
+            QElapsedTimer sinceLastTick;
+            qint64 maxGap = 0;
+            int ticksWhileSending = 0;
+            QTimer ticker;
+            ticker.setInterval(1);
+
+            UploadJob* uj = new UploadJob(source, deviceId);
+            QSignalSpy spyUpload(uj, &KJob::result);
+            QCOMPARE(uj->state(), UploadJob::Idle);
+            const Transfer transfer = prepareTransfer(uj, deviceId, size, destFile);
+            QCOMPARE(uj->state(), UploadJob::Listening);
+
+            //The job deletes itself once it's done
+            QPointer<UploadJob> upload(uj);
+            connect(&ticker, &QTimer::timeout, this, [&]() {
+                maxGap = qMax(maxGap, sinceLastTick.restart());
+                if (upload && upload->state() == UploadJob::Sending) {
+                    ++ticksWhileSending;
+                }
+            });
+            QVERIFY(transfer.download->getPayload()->open(QIODevice::ReadOnly));
+            FileTransferJob* ft = transfer.transfer;
+            QSignalSpy spyTransfer(ft, &KJob::result);
+            ft->start();
+            transfer.download->start();
+            sinceLastTick.start();
+            ticker.start();
+
+            QVERIFY(spyUpload.count() || spyUpload.wait(60000));
+            QVERIFY(spyTransfer.count() || spyTransfer.wait(60000));
+            ticker.stop();
+
+            qDebug() << "Longest event loop stall during the upload:" << maxGap << "ms," << ticksWhileSending << "ticks while sending";
+            QVERIFY2(ticksWhileSending > 0, "The upload blocked the event loop");
+            QCOMPARE(uj->error(), 0);
+            QCOMPARE(qint64(uj->totalAmount(KJob::Bytes)), size);
+            QCOMPARE(qint64(uj->processedAmount(KJob::Bytes)), size);
+            QCOMPARE(QFile(destFile).size(), size);
+            QFile(destFile).remove();
+        }
+
     private:
+        //Trusts our own certificate, so the jobs can talk to each other over localhost
+        QString trustSelf()
+        {
+            KdeConnectConfig* kcc = KdeConnectConfig::instance();
+            const QString deviceId = kcc->deviceId();
+            kcc->addTrustedDevice(deviceId, QStringLiteral("testdevice"), kcc->deviceType());
+            kcc->setDeviceProperty(deviceId, QStringLiteral("certificate"), QString::fromLatin1(kcc->certificate().toPem()));
+            return deviceId;
+        }
+
+        //A file of size bytes made of block over and over, or of zeros without one. Null if it couldn't be written.
+        QSharedPointer<QTemporaryFile> createSource(qint64 size, const QByteArray& block = QByteArray())
+        {
+            QSharedPointer<QTemporaryFile> source(new QTemporaryFile);
+            if (!source->open()) {
+                return QSharedPointer<QTemporaryFile>();
+            }
+            if (block.isEmpty()) {
+                if (!source->resize(size)) {
+                    return QSharedPointer<QTemporaryFile>();
+                }
+            } else {
+                for (qint64 written = 0; written < size; written += block.size()) {
+                    if (source->write(block.constData(), qMin<qint64>(block.size(), size - written)) <= 0) {
+                        return QSharedPointer<QTemporaryFile>();
+                    }
+                }
+            }
+            source->close();
+            return source;
+        }
+
+        struct Transfer {
+            QVariantMap info; //What the receiving end would get in the packet
+            DownloadJob* download;
+            FileTransferJob* transfer;
+        };
+
+        //Starts @p upload and sets up the jobs that download it into @p destination, which the test starts
+        Transfer prepareTransfer(UploadJob* upload, const QString& deviceId, qint64 size, const QString& destination)
+        {
+            Transfer transfer;
+            upload->start();
+            transfer.info = upload->transferInfo();
+            transfer.info.insert(QStringLiteral("deviceId"), deviceId);
+            transfer.info.insert(QStringLiteral("size"), size);
+            transfer.download = new DownloadJob(QHostAddress::LocalHost, transfer.info);
+            transfer.transfer = new FileTransferJob(transfer.download->getPayload(), size, QUrl::fromLocalFile(destination));
+            return transfer;
+        }
+
         TestDaemon* m_daemon;
 };
 
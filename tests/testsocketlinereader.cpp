@@ -24,6 +24,7 @@
 #include <QProcess>
 #include <QEventLoop>
 #include <QTimer>
+#include <QElapsedTimer>
 
 class TestSocketLineReader : public QObject
 {
@@ -34,6 +35,7 @@ public Q_SLOTS:
 
 private Q_SLOTS:
     void socketLineReader();
+    void socketLineReaderThroughput();
 
 private:
     QTimer m_timer;
@@ -96,6 +98,51 @@ void TestSocketLineReader::socketLineReader()
     }
 }
 
+void TestSocketLineReader::socketLineReaderThroughput()
+{
+    QSslSocket client;
+    client.connectToHost(QHostAddress::LocalHost, 8694);
+    QVERIFY2(client.waitForConnected(), "Could not connect to local tcp server");
+    QVERIFY(m_server->hasPendingConnections() || m_server->waitForNewConnection(4000));
+    QSslSocket* sock = m_server->nextPendingConnection();
+    QVERIFY2(sock != nullptr, "Could not open a connection to the client");
+
+    const QByteArray packet("{\"id\":1439365924847,\"type\":\"kdeconnect.mousepad.request\",\"body\":{\"dx\":1.5,\"dy\":-2}}\n");
+    const int packetCount = 100000;
+    QByteArray data;
+    data.reserve(packet.size() * packetCount);
+    for (int i = 0; i < packetCount; ++i) {
+        data.append(packet);
+    }
+
+    QEventLoop loop;
+    SocketLineReader reader(sock);
+    int received = 0;
+    bool allMatch = true;
+    connect(&reader, &SocketLineReader::readyRead, &loop, [&]() {
+        while (reader.bytesAvailable() > 0) {
+            allMatch = allMatch && reader.readLineInPlace() == packet;
+            ++received;
+        }
+        if (received == packetCount) {
+            loop.quit();
+        }
+    });
+    QTimer::singleShot(30000, &loop, &QEventLoop::quit);
+
+    QElapsedTimer timer;
+    timer.start();
+    client.write(data);
+    loop.exec();
+    const qint64 elapsed = timer.elapsed();
+
+    QCOMPARE(received, packetCount);
+    QVERIFY(allMatch);
+    qDebug() << packetCount << "packets framed in" << elapsed << "ms";
+
+    delete sock;
+}
+
 void TestSocketLineReader::newPacket()
 {
     if (!m_reader->bytesAvailable()) {